@@ -1,7 +1,7 @@
 #!/bin/bash
 
 
-declare -a files=("aux.fa" "c1.fa" "ce.fa" "xx.fa" "aux#aux.sam" "c1#pad3.sam" "ce#large_seq.sam" "ce#unmap2.sam" "xx#minimal.sam" "c1#bounds.sam" "ce#1.sam" "ce#tag_depadded.sam" "fieldarith.sam" "xx#pair.sam" "c1#clip.sam" "ce#2.sam" "ce#tag_padded.sam" "xx#blank.sam" "xx#rg.sam" "c1#pad1.sam" "ce#5.sam" "ce#unmap.sam" "xx#large_aux.sam" "xx#triplet.sam" "c1#pad2.sam" "ce#5b.sam" "ce#unmap1.sam" "xx#large_aux2.sam" "xx#unsorted.sam")
+declare -a files=("aux.fa" "c1.fa" "ce.fa" "xx.fa" "aux#aux.sam" "c1#pad3.sam" "ce#large_seq.sam" "ce#unmap2.sam" "xx#minimal.sam" "c1#bounds.sam" "ce#1.sam" "ce#tag_depadded.sam" "fieldarith.sam" "xx#pair.sam" "c1#clip.sam" "ce#2.sam" "ce#tag_padded.sam" "xx#blank.sam" "xx#rg.sam" "c1#pad1.sam" "ce#5.sam" "ce#unmap.sam" "xx#large_aux.sam" "xx#triplet.sam" "c1#pad2.sam" "ce#5b.sam" "ce#unmap1.sam" "xx#large_aux2.sam" "xx#unsorted.sam" "xx#supp.sam")
 
 echo "Running samstat tests:";
 
@@ -20,6 +20,15 @@ fi
 
 done
 
+# secondary and supplementary records repeat the TLEN of their pair
+if grep -q "<td>FR</td><td>MAPQ &gt;= 30</td><td>1</td>" "xx#supp.sam.samstat.html"; then
+	printf "%10s%20s%10s\n"  samstat "insert sizes" SUCCESS;
+else
+	printf "%10s%20s%10s\n"  samstat "insert sizes" FAILED;
+	printf "xx#supp.sam: the pair was not counted exactly once.\n\n";
+	exit 1;
+fi
+
 
 
 
@@ -0,0 +1,172 @@
+#include "samstat.h"
+#include "contig.h"
+
+static unsigned int hash_name(const char* name,int name_len);
+static int grow_contig_table(struct contig_table* ct);
+
+struct contig_table* init_contig_table(void)
+{
+        struct contig_table* ct = NULL;
+        int i;
+
+        MMALLOC(ct, sizeof(struct contig_table));
+        ct->names = NULL;
+        ct->len = NULL;
+        ct->ref_id = NULL;
+        ct->slots = NULL;
+        ct->hash = NULL;
+        ct->num_contigs = 0;
+        ct->alloc_contigs = 64;
+        ct->num_slots = 128;
+        ct->last_id = -1;
+
+        MMALLOC(ct->names, sizeof(char*) * ct->alloc_contigs);
+        MMALLOC(ct->len, sizeof(int) * ct->alloc_contigs);
+        MMALLOC(ct->ref_id, sizeof(int) * ct->alloc_contigs);
+        MMALLOC(ct->hash, sizeof(unsigned int) * ct->alloc_contigs);
+        MMALLOC(ct->slots, sizeof(int) * ct->num_slots);
+        for(i = 0; i < ct->num_slots;i++){
+                ct->slots[i] = 0;
+        }
+        return ct;
+ERROR:
+        free_contig_table(ct);
+        return NULL;
+}
+
+int clear_contig_table(struct contig_table* ct)
+{
+        int i;
+        ASSERT(ct != NULL, "No contig table");
+        for(i = 0; i < ct->num_contigs;i++){
+                MFREE(ct->names[i]);
+        }
+        for(i = 0; i < ct->num_slots;i++){
+                ct->slots[i] = 0;
+        }
+        ct->num_contigs = 0;
+        ct->last_id = -1;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_contig_table(struct contig_table* ct)
+{
+        int i;
+        if(ct){
+                if(ct->names){
+                        for(i = 0; i < ct->num_contigs;i++){
+                                MFREE(ct->names[i]);
+                        }
+                        MFREE(ct->names);
+                }
+                if(ct->len){
+                        MFREE(ct->len);
+                }
+                if(ct->ref_id){
+                        MFREE(ct->ref_id);
+                }
+                if(ct->hash){
+                        MFREE(ct->hash);
+                }
+                if(ct->slots){
+                        MFREE(ct->slots);
+                }
+                MFREE(ct);
+        }
+}
+
+/* Returns the ID of name, adding it if it has not been seen. len is the
+   contig length if known (from @SQ LN:), otherwise 0. */
+int contig_table_intern(struct contig_table* ct,const char* name,int name_len,int len)
+{
+        unsigned int h;
+        int mask = ct->num_slots - 1;
+        int s,id;
+
+        /* sorted input - consecutive reads usually hit the same contig */
+        id = ct->last_id;
+        if(id != -1 && !strncmp(ct->names[id], name, name_len) && ct->names[id][name_len] == 0){
+                return id;
+        }
+
+        h = hash_name(name, name_len);
+        s = h & mask;
+        while(ct->slots[s]){
+                id = ct->slots[s] - 1;
+                if(ct->hash[id] == h && !strncmp(ct->names[id], name, name_len) && ct->names[id][name_len] == 0){
+                        if(len){
+                                ct->len[id] = len;
+                        }
+                        ct->last_id = id;
+                        return id;
+                }
+                s = (s + 1) & mask;
+        }
+
+        if(ct->num_contigs == ct->alloc_contigs){
+                RUN(grow_contig_table(ct));
+                mask = ct->num_slots - 1;
+                s = h & mask;
+                while(ct->slots[s]){
+                        s = (s + 1) & mask;
+                }
+        }
+        id = ct->num_contigs;
+        ct->names[id] = NULL;
+        MMALLOC(ct->names[id], sizeof(char) * (name_len + 1));
+        memcpy(ct->names[id], name, name_len);
+        ct->names[id][name_len] = 0;
+        ct->len[id] = len;
+        ct->ref_id[id] = -2;
+        ct->hash[id] = h;
+        ct->slots[s] = id + 1;
+        ct->num_contigs++;
+        ct->last_id = id;
+        return id;
+ERROR:
+        return -1;
+}
+
+/* Doubles the ID space and the slot array, keeping the load below 0.5. */
+static int grow_contig_table(struct contig_table* ct)
+{
+        int i,s,mask;
+
+        ct->alloc_contigs = ct->alloc_contigs << 1;
+        MREALLOC(ct->names, sizeof(char*) * ct->alloc_contigs);
+        MREALLOC(ct->len, sizeof(int) * ct->alloc_contigs);
+        MREALLOC(ct->ref_id, sizeof(int) * ct->alloc_contigs);
+        MREALLOC(ct->hash, sizeof(unsigned int) * ct->alloc_contigs);
+
+        ct->num_slots = ct->alloc_contigs << 1;
+        MFREE(ct->slots);
+        MMALLOC(ct->slots, sizeof(int) * ct->num_slots);
+        for(i = 0; i < ct->num_slots;i++){
+                ct->slots[i] = 0;
+        }
+        mask = ct->num_slots - 1;
+        for(i = 0; i < ct->num_contigs;i++){
+                s = ct->hash[i] & mask;
+                while(ct->slots[s]){
+                        s = (s + 1) & mask;
+                }
+                ct->slots[s] = i + 1;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* FNV-1a */
+static unsigned int hash_name(const char* name,int name_len)
+{
+        unsigned int h = 2166136261u;
+        int i;
+        for(i = 0; i < name_len;i++){
+                h ^= (unsigned char) name[i];
+                h *= 16777619u;
+        }
+        return h;
+}
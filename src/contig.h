@@ -0,0 +1,26 @@
+#ifndef CONTIG_HEADER
+
+#define CONTIG_HEADER
+
+/* Interns reference names (from @SQ header lines or RNAME) into dense
+   integer IDs so per-contig statistics can be indexed directly. */
+
+struct contig_table{
+        char** names;
+        int* len;
+        int* ref_id;/**< @brief Index into the -ref fasta; -2 = not looked up yet. */
+        int* slots;/**< @brief Open addressing hash: contig ID + 1, 0 = empty. */
+        unsigned int* hash;
+        int num_contigs;
+        int alloc_contigs;
+        int num_slots;
+        int last_id;
+};
+
+struct contig_table* init_contig_table(void);
+int clear_contig_table(struct contig_table* ct);
+void free_contig_table(struct contig_table* ct);
+
+int contig_table_intern(struct contig_table* ct,const char* name,int name_len,int len);
+
+#endif
@@ -3,118 +3,363 @@
 #include "hmm.h"
 #include <pthread.h>
 
+static int run_pHMM_jobs(struct hmm** hmms,int num_hmm,const int* start,struct hmm_data* data);
+static int prepare_hmm_worker(struct hmm_data* data,int t,struct hmm* hmm);
+static void* run_hmm_batches(void *threadarg);
+static void take_batch_estimates(struct hmm* hmm,float* est);
+static void add_batch_estimates(struct hmm* hmm,const float* est);
+static int alloc_dp_matrices(struct hmm* hmm);
+static void free_dp_matrices(struct hmm* hmm);
+static int alloc_chain_workspace(struct hmm* hmm);
+static void free_chain_workspace(struct hmm* hmm);
+static void chain_load_path(struct hmm* hmm,int len);
+static void chain_load_block(struct hmm* hmm,char** a,int n,int first,int last);
+static void chain_forward(struct hmm* hmm,char** a,int n,int len,int lanes,float* score);
+static void chain_backward(struct hmm* hmm,char** a,int n,int len,int lanes,float* score);
+static void chain_collect_estimated(struct hmm* hmm,const char* a,int r,float total,int len);
+static void chain_baum_welch(struct hmm* hmm,char** a,const float* weight,int n,int len);
+static int chain_batch_size(struct hmm_data* data,int first,int end);
+static int qsort_hmm_read_cmp(const void *a, const void *b);
+static struct hmm* forward_scaled(struct hmm* hmm, char* a, int len);
+static struct hmm* backward_scaled(struct hmm* hmm, char* a, int len);
+static struct hmm* collect_scaled(struct hmm* hmm, char* a,float weight, int len);
 
+/* Runs Baum-Welch until the log likelihood of the data improves by less
+   than data->tolerance (relative) or for at most data->iterations rounds.
+   hmm->em_iterations and hmm->log_likelihood record the last round; the
+   likelihood is that of the parameters going into it. */
 int run_EM_iterations(struct hmm* hmm,struct hmm_data* data)
 {
-        int i;
-        
+        int start[2];
+
+        start[0] = 0;
+        start[1] = data->num_seq;
+        return run_EM_models(&hmm, 1, start, data);
+}
+
+/* Trains num_hmm models at once, hmms[m] on reads start[m] .. start[m+1]-1
+   of data; NULL models are skipped. All models still training share each
+   round's batches (see run_pHMM_jobs) and each stops on its own as in
+   run_EM_iterations. */
+int run_EM_models(struct hmm** hmms,int num_hmm,const int* start,struct hmm_data* data)
+{
+        struct hmm** active = NULL;
+        double* last = NULL;
+        int i,m,n;
+
+        ASSERT(num_hmm > 0, "No models.");
+        MMALLOC(active, sizeof(struct hmm*) * num_hmm);
+        MMALLOC(last, sizeof(double) * num_hmm);
+        n = 0;
+        for(m = 0; m < num_hmm;m++){
+                active[m] = hmms[m];
+                last[m] = -INFINITY;
+                if(hmms[m]){
+                        hmms[m]->em_iterations = 0;
+                        n++;
+                }
+        }
         data->run_mode = MODE_BAUM_WELCH;
-	
-        for(i = 0; i < data->iterations;i++ ){
-                RUN(run_pHMM(hmm, data));
-                RUN(reestimate_hmm_parameters(hmm));
+
+        for(i = 0; i < data->iterations && n;i++ ){
+                RUN(run_pHMM_jobs(active, num_hmm, start, data));
+                for(m = 0; m < num_hmm;m++){
+                        if(!active[m]){
+                                continue;
+                        }
+                        RUN(reestimate_hmm_parameters(active[m]));
+                        active[m]->em_iterations++;
 #ifdef DEBUG
-                fprintf(stderr,"Iteration:%d\n",i);
-                print_hmm_parameters(hmm);
+                        fprintf(stderr,"Model:%d iteration:%d log likelihood:%f\n",m,i,active[m]->log_likelihood);
+                        print_hmm_parameters(active[m]);
 #endif
+                        if(i && active[m]->log_likelihood - last[m] <= data->tolerance * fabs(last[m])){
+                                active[m] = NULL;
+                                n--;
+                        }else{
+                                last[m] = active[m]->log_likelihood;
+                        }
+                }
         }
+        MFREE(active);
+        MFREE(last);
         return OK;
 ERROR:
+        if(active){
+                MFREE(active);
+        }
+        if(last){
+                MFREE(last);
+        }
         return FAIL;
 }
 
 int  run_pHMM(struct hmm* hmm,struct hmm_data* data)
 {
-        struct thread_data* thread_data = NULL;
-        int t;
-	
-        int interval = 0;
-        int rc;
-	
-        
-        
-        int num_threads = data->num_threads;
-        int numseq = data->num_seq;
-        int mode = data->run_mode;
+        int start[2];
 
-        pthread_t threads[num_threads];
-        pthread_attr_t attr;
-  
         ASSERT(data != NULL," No data.");
-        
-        MMALLOC(thread_data,sizeof(struct thread_data)* num_threads);
-        
+        start[0] = 0;
+        start[1] = data->num_seq;
+        RUN(run_pHMM_jobs(&hmm, 1, start, data));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* One pass of data->run_mode over the reads of all (non NULL) models.
+   The reads are cut into batches of about equal work (length x states),
+   about HMM_BATCHES_PER_THREAD per thread, and each thread pulls the next
+   batch off a shared counter until none are left, so a thread that got
+   long reads or runs on a slow core simply takes fewer batches. Every
+   batch leaves its expected counts in its own slot of data->batch_est;
+   the slots are merged in batch order once per pass, so the result does
+   not depend on which thread ran what. */
+static int run_pHMM_jobs(struct hmm** hmms,int num_hmm,const int* start,struct hmm_data* data)
+{
+        struct thread_data* td = NULL;
+        struct hmm_batch* batch = NULL;
+        long long int total = 0;
+        long long int target;
+        long long int w;
+        int est_size = 0;
+        int first;
+        int i,m,t;
+
+        ASSERT(data != NULL," No data.");
+        ASSERT(data->num_threads > 0, "No threads.");
+
         /* to be safe */
         init_logsum();
-	
-        interval =  (int)((double)numseq /(double)num_threads);
-	
-        for(t = 0;t < num_threads ;t++) {
-                thread_data[t].data = data;
-                thread_data[t].hmm = copy_hmm(hmm);
-                thread_data[t].start = t*interval;
-                thread_data[t].end = t*interval + interval;
-		
+
+        for(m = 0; m < num_hmm;m++){
+                if(hmms[m]){
+                        hmms[m]->log_likelihood = 0.0;
+                        for(i = start[m]; i < start[m+1];i++){
+                                total += (long long int) data->length[i] * hmms[m]->num_states;
+                        }
+                }
         }
-        thread_data[num_threads-1].end = numseq;
-        //unsigned int seed = (unsigned int) (time(NULL) * ( 42));
-	
-        rc = pthread_attr_init(&attr);
-        if(rc){
-                //sprintf(param->buffer,"ERROR; return code from pthread_attr_init() is %d\n", rc);
-                //param->messages = append_message(param->messages, param->buffer);
-		
-                //free_param(param);
-                exit(EXIT_FAILURE);
+        target = total / (data->num_threads * HMM_BATCHES_PER_THREAD) + 1;
+
+        data->num_batches = 0;
+        for(m = 0; m < num_hmm;m++){
+                if(!hmms[m]){
+                        continue;
+                }
+                first = start[m];
+                w = 0;
+                for(i = start[m]; i < start[m+1];i++){
+                        w += (long long int) data->length[i] * hmms[m]->num_states;
+                        if(w >= target || i == start[m+1] - 1){
+                                if(data->num_batches == data->alloc_batches){
+                                        data->alloc_batches = data->alloc_batches ? data->alloc_batches << 1 : 64;
+                                        MREALLOC(data->batches, sizeof(struct hmm_batch) * data->alloc_batches);
+                                }
+                                batch = data->batches + data->num_batches;
+                                batch->start = first;
+                                batch->end = i + 1;
+                                batch->model = m;
+                                batch->est = est_size;
+                                batch->log_likelihood = 0.0;
+                                est_size += hmms[m]->num_states * (hmms[m]->num_states + hmms[m]->alphabet_len);
+                                data->num_batches++;
+                                first = i + 1;
+                                w = 0;
+                        }
+                }
         }
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	
-        for(t = 0;t < num_threads;t++) {
-                switch (mode) {
-                case MODE_BAUM_WELCH:
-                        rc = pthread_create(&threads[t], &attr, do_baum_welch, (void *) &thread_data[t]);
-                        break;
-                case MODE_FORWARD:
-                        rc = pthread_create(&threads[t], &attr, do_forward, (void *) &thread_data[t]);
-                        break;
+        if(!data->num_batches){
+                return OK;
+        }
+        if(data->run_mode == MODE_BAUM_WELCH && est_size > data->alloc_est){
+                data->alloc_est = est_size;
+                MREALLOC(data->batch_est, sizeof(float) * data->alloc_est);
+        }
+
+        /* workspaces: one per thread and model, data->workers[t * num_hmm + m];
+           all have to be in place before the first thread starts - adding
+           one may move data->workers */
+        for(t = 0; t < data->num_threads;t++){
+                for(m = 0; m < num_hmm;m++){
+                        if(hmms[m]){
+                                RUN(prepare_hmm_worker(data, t * num_hmm + m, hmms[m]));
+                                data->workers[t * num_hmm + m].data = data;
+                        }
                 }
-		
-                if (rc) {
-                        //sprintf(param->buffer,"ERROR; return code from pthread_create() is %d\n", rc);
-                        //param->messages = append_message(param->messages, param->buffer);
-                        //free_param(param);
-                        exit(EXIT_FAILURE );
+        }
+        data->next_batch = 0;
+        for(t = 0;t < data->num_threads ;t++) {
+                td = data->workers + t * num_hmm;
+                td->data = data;
+                if(thr_pool_queue(data->pool, run_hmm_batches, (void *) td) == -1){
+                        ERROR_MSG("Could not queue HMM job.");
                 }
         }
-	
-        pthread_attr_destroy(&attr);
-	
-        for (t = 0;t < num_threads;t++){
-                rc = pthread_join(threads[t], NULL);
-                if (rc){
-                        //sprintf(param->buffer,"ERROR; return code from pthread_join()is %d\n", rc);
-                        //param->messages = append_message(param->messages, param->buffer);
-                        //free_param(param);
-                        exit(EXIT_FAILURE );
+        thr_pool_wait(data->pool);
+
+        if(data->run_mode == MODE_BAUM_WELCH){
+                for(i = 0; i < data->num_batches;i++){
+                        batch = data->batches + i;
+                        add_batch_estimates(hmms[batch->model], data->batch_est + batch->est);
+                        hmms[batch->model]->log_likelihood += batch->log_likelihood;
                 }
         }
-	
-        for (t = 0;t < num_threads;t++){
-                hmm =  copy_estimated_parameters(hmm, thread_data[t].hmm);
+        return OK;
+ERROR:
+        if(data && data->pool){
+                thr_pool_wait(data->pool);
         }
-	
-	
-	
-        for(t = 0;t < num_threads;t++) {
-                free_hmm(thread_data[t].hmm);
+        return FAIL;
+}
+
+/* Thread side of run_pHMM_jobs: td is the thread's workspace for model 0,
+   td + m the one for model m. */
+static void* run_hmm_batches(void *threadarg)
+{
+        struct thread_data* td = (struct thread_data *) threadarg;
+        struct hmm_data* data = td->data;
+        struct thread_data* w = NULL;
+        struct hmm_batch* batch = NULL;
+        int i;
+
+        while((i = __atomic_fetch_add(&data->next_batch, 1, __ATOMIC_RELAXED)) < data->num_batches){
+                batch = data->batches + i;
+                w = td + batch->model;
+                w->start = batch->start;
+                w->end = batch->end;
+                if(data->run_mode == MODE_BAUM_WELCH){
+                        do_baum_welch(w);
+                        batch->log_likelihood = w->hmm->log_likelihood;
+                        take_batch_estimates(w->hmm, data->batch_est + batch->est);
+                }else{
+                        do_forward(w);
+                }
+        }
+        return NULL;
+}
+
+/* Moves the estimates of a workspace into est (transitions, then
+   emissions, row by row) and leaves the workspace empty for the next batch. */
+static void take_batch_estimates(struct hmm* hmm,float* est)
+{
+        int i,j;
+
+        for(i = 0; i < hmm->num_states;i++){
+                for(j = 0; j < hmm->num_states;j++){
+                        *est++ = hmm->transitions_e[i][j];
+                        hmm->transitions_e[i][j] = -INFINITY;
+                }
+        }
+        for(i = 0; i < hmm->num_states;i++){
+                for(j = 0; j < hmm->alphabet_len;j++){
+                        *est++ = i > 1 ? hmm->emissions_e[i][j] : -INFINITY;
+                        if(i > 1){
+                                hmm->emissions_e[i][j] = -INFINITY;
+                        }
+                }
+        }
+}
+
+static void add_batch_estimates(struct hmm* hmm,const float* est)
+{
+        int i,j;
+
+        for(i = 0; i < hmm->num_states;i++){
+                for(j = 0; j < hmm->num_states;j++){
+                        hmm->transitions_e[i][j] = logsum(hmm->transitions_e[i][j], *est++);
+                }
+        }
+        for(i = 0; i < hmm->num_states;i++){
+                for(j = 0; j < hmm->alphabet_len;j++){
+                        if(i > 1){
+                                hmm->emissions_e[i][j] = logsum(hmm->emissions_e[i][j], *est);
+                        }
+                        est++;
+                }
+        }
+}
+
+/* Creates the thread pool on first use and makes sure slot t has a
+   workspace HMM (with its own F / B matrices or chain buffers) holding the
+   current parameters of hmm. Workspaces are kept across runs and models and
+   only reallocated if too small or of the wrong kind. Their estimates start
+   empty so the pseudocounts in hmm are counted once, however many batches
+   the reads are cut into. */
+static int prepare_hmm_worker(struct hmm_data* data,int t,struct hmm* hmm)
+{
+        struct hmm* ws = NULL;
+        int i,j;
+
+        if(!data->pool){
+                ASSERT(data->num_threads > 0, "No threads.");
+                data->pool = thr_pool_create(data->num_threads, data->num_threads, 0, NULL);
+                ASSERT(data->pool != NULL, "Could not create thread pool.");
+        }
+        if(t >= data->num_workers){
+                MREALLOC(data->workers, sizeof(struct thread_data) * (t + 1));
+                for(i = data->num_workers; i <= t;i++){
+                        data->workers[i].hmm = NULL;
+                }
+                data->num_workers = t + 1;
+        }
+        ws = data->workers[t].hmm;
+        if(ws && (ws->num_states != hmm->num_states || ws->alphabet_len != hmm->alphabet_len || ws->max_seq_len < hmm->max_seq_len || (ws->chain_loop == -1) != (hmm->chain_loop == -1))){
+                free_hmm(ws);
+                ws = NULL;
+                data->workers[t].hmm = NULL;
+        }
+        if(ws){
+                copy_hmm_parameters(ws, hmm);
+        }else{
+                RUNP(ws = copy_hmm(hmm));
+                data->workers[t].hmm = ws;
+        }
+        for(i = 0; i < ws->num_states;i++){
+                for(j = 0; j < ws->num_states;j++){
+                        ws->transitions_e[i][j] = -INFINITY;
+                }
+        }
+        for(i = 2; i < ws->num_states;i++){
+                for(j = 0; j < ws->alphabet_len;j++){
+                        ws->emissions_e[i][j] = -INFINITY;
+                }
         }
-	
-        MFREE(thread_data);
         return OK;
 ERROR:
         return FAIL;
 }
 
+void free_hmm_workers(struct hmm_data* data)
+{
+        int t;
+        if(data->pool){
+                thr_pool_destroy(data->pool);
+                data->pool = NULL;
+        }
+        if(data->workers){
+                for(t = 0; t < data->num_workers;t++){
+                        if(data->workers[t].hmm){
+                                free_hmm(data->workers[t].hmm);
+                        }
+                }
+                MFREE(data->workers);
+                data->workers = NULL;
+        }
+        data->num_workers = 0;
+        if(data->batches){
+                MFREE(data->batches);
+                data->batches = NULL;
+        }
+        data->num_batches = 0;
+        data->alloc_batches = 0;
+        if(data->batch_est){
+                MFREE(data->batch_est);
+                data->batch_est = NULL;
+        }
+        data->alloc_est = 0;
+}
+
 void* do_baum_welch(void *threadarg)
 {
         struct thread_data *data;
@@ -126,17 +371,31 @@ void* do_baum_welch(void *threadarg)
         int start = data->start;
         int end = data->end;
 	
-        int i;
-	
-        for(i = start; i < end;i++){
-                hmm = forward(hmm,hmm_data->string[i], hmm_data->length[i]);
-		
-                hmm = backward(hmm,hmm_data->string[i], hmm_data->length[i]);
-		
-                hmm = collect_estimated(hmm,hmm_data->string[i], hmm_data->weight[i], hmm_data->length[i]);
-		
+        int i,n;
+
+        hmm->log_likelihood = 0.0;
+        if(hmm->scaled){
+                set_scaled_parameters(hmm);
+        }
+        if(hmm->chain_loop != -1){
+                for(i = start; i < end;i += n){
+                        n = chain_batch_size(hmm_data, i, end);
+                        chain_baum_welch(hmm, hmm_data->string + i, hmm_data->weight + i, n, hmm_data->length[i]);
+                }
+        }else{
+                for(i = start; i < end;i++){
+                        hmm = forward(hmm,hmm_data->string[i], hmm_data->length[i]);
+                        hmm = backward(hmm,hmm_data->string[i], hmm_data->length[i]);
+                        hmm = collect_estimated(hmm,hmm_data->string[i], hmm_data->weight[i], hmm_data->length[i]);
+                        if(hmm->f_score != -INFINITY){
+                                hmm->log_likelihood += hmm->f_score;
+                        }
+                }
         }
-        pthread_exit((void *) 0);
+        if(hmm->scaled){
+                add_scaled_estimates(hmm);
+        }
+        return NULL;
 }
 
 void* do_forward(void *threadarg)
@@ -150,7 +409,23 @@ void* do_forward(void *threadarg)
         int start = data->start;
         int end = data->end;
 	
-        int i;
+        float score[HMM_LANES];
+        int i,n,r;
+
+        if(hmm->scaled){
+                set_scaled_parameters(hmm);
+        }
+        if(hmm->chain_loop != -1){
+                for(i = start; i < end;i += n){
+                        n = chain_batch_size(hmm_data, i, end);
+                        chain_load_path(hmm, hmm_data->length[i]);
+                        chain_forward(hmm, hmm_data->string + i, n, hmm_data->length[i], n == 1 ? 1 : HMM_LANES, score);
+                        for(r = 0; r < n;r++){
+                                hmm_data->score[i+r] = score[r];
+                        }
+                }
+                return NULL;
+        }
 	
         for(i = start; i < end;i++){
                 hmm = forward(hmm,hmm_data->string[i], hmm_data->length[i]);
@@ -158,8 +433,7 @@ void* do_forward(void *threadarg)
 		
 		
         }
-        pthread_exit((void *) 0);
-	
+        return NULL;
 }
 
 struct hmm* malloc_hmm(int num_states, int alphabet_len, int max_seq_len)
@@ -170,6 +444,10 @@ struct hmm* malloc_hmm(int num_states, int alphabet_len, int max_seq_len)
         hmm->alphabet_len =  alphabet_len;
         hmm->num_states = num_states;
         hmm->max_seq_len = max_seq_len;
+        hmm->chain_loop = -1;
+        hmm->scaled = 0;
+        hmm->log_likelihood = 0.0;
+        hmm->em_iterations = 0;
         hmm->emissions = NULL;
         hmm->transitions = NULL;
 	
@@ -185,6 +463,21 @@ struct hmm* malloc_hmm(int num_states, int alphabet_len, int max_seq_len)
 	
         hmm->F_memory = NULL;
         hmm->B_memory = NULL;
+
+        hmm->scale = NULL;
+        hmm->path_ck = NULL;
+        hmm->path_B = NULL;
+        hmm->path_e = NULL;
+        hmm->path_eb = NULL;
+        hmm->path_bb = NULL;
+        hmm->path_s = NULL;
+        hmm->path_t = NULL;
+        hmm->chain_block = 0;
+        hmm->path_block = 0;
+        hmm->lin_trans = NULL;
+        hmm->lin_emit = NULL;
+        hmm->count_trans = NULL;
+        hmm->count_emit = NULL;
 	
         MMALLOC(hmm->emissions,sizeof(float*) * num_states);
         MMALLOC(hmm->transitions,sizeof(float*) * num_states);
@@ -212,16 +505,11 @@ struct hmm* malloc_hmm(int num_states, int alphabet_len, int max_seq_len)
 		
 		
         }
-        MMALLOC(hmm->F_memory ,sizeof(float*) * num_states *max_seq_len );
-        MMALLOC(hmm->B_memory, sizeof(float*) * num_states * max_seq_len);
-	
-        MMALLOC(hmm->F ,sizeof(float*) * max_seq_len);
-        MMALLOC(hmm->B,sizeof(float*) * max_seq_len);
-	
-        for(i = 0; i < max_seq_len;i++){
-                hmm->F[i] = (float*) (hmm->F_memory + i *num_states);
-                hmm->B[i] = (float*) (hmm->B_memory + i *num_states);
-        }
+        MMALLOC(hmm->lin_trans, sizeof(float) * num_states * num_states);
+        MMALLOC(hmm->lin_emit, sizeof(float) * num_states * alphabet_len);
+        MMALLOC(hmm->count_trans, sizeof(double) * num_states * num_states);
+        MMALLOC(hmm->count_emit, sizeof(double) * num_states * alphabet_len);
+        RUN(alloc_dp_matrices(hmm));
         //MMALLOC(hmm->F ,sizeof(float*) * num_states);
         //MMALLOC(hmm->B,sizeof(float*) * num_states);
 	
@@ -250,10 +538,12 @@ void free_hmm(struct hmm* hmm)
 		
                 }
 	
-                MFREE(hmm->F);
-                MFREE(hmm->B);
-                MFREE(hmm->F_memory);
-                MFREE(hmm->B_memory);
+                free_dp_matrices(hmm);
+                free_chain_workspace(hmm);
+                MFREE(hmm->lin_trans);
+                MFREE(hmm->lin_emit);
+                MFREE(hmm->count_trans);
+                MFREE(hmm->count_emit);
 	
                 MFREE(hmm->transitions);
                 MFREE(hmm->tindex);
@@ -264,6 +554,117 @@ void free_hmm(struct hmm* hmm)
         }
 }
 
+/* Full F / B matrices for the generic recursions: (max_seq_len) rows of
+   num_states each, plus the row scaling factors of the scaled mode. */
+static int alloc_dp_matrices(struct hmm* hmm)
+{
+        int i;
+
+        MMALLOC(hmm->F_memory ,sizeof(float) * hmm->num_states * hmm->max_seq_len);
+        MMALLOC(hmm->B_memory, sizeof(float) * hmm->num_states * hmm->max_seq_len);
+        MMALLOC(hmm->F ,sizeof(float*) * hmm->max_seq_len);
+        MMALLOC(hmm->B,sizeof(float*) * hmm->max_seq_len);
+        MMALLOC(hmm->scale, sizeof(float) * hmm->max_seq_len);
+        for(i = 0; i < hmm->max_seq_len;i++){
+                hmm->F[i] = (float*) (hmm->F_memory + i * hmm->num_states);
+                hmm->B[i] = (float*) (hmm->B_memory + i * hmm->num_states);
+        }
+        return OK;
+ERROR:
+        free_dp_matrices(hmm);
+        return FAIL;
+}
+
+static void free_dp_matrices(struct hmm* hmm)
+{
+        if(hmm->F){
+                MFREE(hmm->F);
+        }
+        if(hmm->B){
+                MFREE(hmm->B);
+        }
+        if(hmm->F_memory){
+                MFREE(hmm->F_memory);
+        }
+        if(hmm->B_memory){
+                MFREE(hmm->B_memory);
+        }
+        if(hmm->scale){
+                MFREE(hmm->scale);
+        }
+}
+
+/* Buffers of the chain kernels: a backward checkpoint every chain_block
+   rows and one block of emissions and backward rows, with chain_block ~
+   sqrt(max_seq_len) (at least HMM_CHAIN_BLOCK). Only the path states and
+   transitions are kept per residue. */
+static int alloc_chain_workspace(struct hmm* hmm)
+{
+        int i;
+
+        hmm->chain_block = HMM_CHAIN_BLOCK;
+        while(hmm->chain_block * hmm->chain_block < hmm->max_seq_len){
+                hmm->chain_block <<= 1;
+        }
+        MMALLOC(hmm->path_ck, sizeof(float) * (hmm->max_seq_len / hmm->chain_block + 2) * HMM_LANES);
+        MMALLOC(hmm->path_B, sizeof(float) * hmm->chain_block * HMM_LANES);
+        MMALLOC(hmm->path_e, sizeof(float) * hmm->chain_block * HMM_LANES);
+        MMALLOC(hmm->path_eb, sizeof(float) * hmm->chain_block);
+        MMALLOC(hmm->path_bb, sizeof(float) * hmm->chain_block);
+        MMALLOC(hmm->path_s, sizeof(int) * hmm->max_seq_len);
+        MMALLOC(hmm->path_t, sizeof(float) * hmm->max_seq_len);
+        /* lanes beyond a short batch keep old (finite) emissions */
+        for(i = 0; i < hmm->chain_block * HMM_LANES;i++){
+                hmm->path_e[i] = 0.0f;
+        }
+        return OK;
+ERROR:
+        free_chain_workspace(hmm);
+        return FAIL;
+}
+
+static void free_chain_workspace(struct hmm* hmm)
+{
+        if(hmm->path_ck){
+                MFREE(hmm->path_ck);
+        }
+        if(hmm->path_B){
+                MFREE(hmm->path_B);
+        }
+        if(hmm->path_e){
+                MFREE(hmm->path_e);
+        }
+        if(hmm->path_eb){
+                MFREE(hmm->path_eb);
+        }
+        if(hmm->path_bb){
+                MFREE(hmm->path_bb);
+        }
+        if(hmm->path_s){
+                MFREE(hmm->path_s);
+        }
+        if(hmm->path_t){
+                MFREE(hmm->path_t);
+        }
+        hmm->chain_block = 0;
+        hmm->path_block = 0;
+}
+
+/* Switches hmm to the chain kernels with the self loop at state loop; the
+   F / B matrices of the generic recursions are released. */
+int set_chain_model(struct hmm* hmm,int loop)
+{
+        ASSERT(hmm != NULL, "No hmm");
+        ASSERT(loop > 1 && loop < hmm->num_states, "Chain loop state %d out of range.", loop);
+        if(hmm->chain_loop == -1){
+                free_dp_matrices(hmm);
+                RUN(alloc_chain_workspace(hmm));
+        }
+        hmm->chain_loop = loop;
+        return OK;
+ERROR:
+        return FAIL;
+}
 
 struct hmm* init_hmm_simple_ID(struct hmm* hmm)
 {
@@ -540,6 +941,32 @@ struct hmm* copy_estimated_parameters(struct hmm* target,struct hmm* source )
 }
 
 
+/* Copies parameters, estimates and transition index of org into an HMM of
+   the same shape (e.g. a worker workspace made by copy_hmm). */
+struct hmm* copy_hmm_parameters(struct hmm* target,struct hmm* org)
+{
+        int i,j;
+
+        target->chain_loop = org->chain_loop;
+        target->scaled = org->scaled;
+        for(i = 0; i < org->num_states;i++){
+                for(j = 0; j < org->tindex[i][0];j++){
+                        target->tindex[i][j]= org->tindex[i][j];
+                }
+                for(j = 0; j < org->num_states;j++){
+                        target->transitions[i][j] = org->transitions[i][j];
+                        target->transitions_e[i][j] = org->transitions_e[i][j] ;
+                }
+        }
+        for(i =2 ; i < org->num_states;i++){
+                for(j = 0; j < org->alphabet_len;j++){
+                        target->emissions[i][j] = org->emissions[i][j];
+                        target->emissions_e[i][j] = org->emissions_e[i][j];
+                }
+        }
+        return target;
+}
+
 struct hmm* copy_hmm(struct hmm* org )
 {
         struct hmm* new = 0;
@@ -548,6 +975,10 @@ struct hmm* copy_hmm(struct hmm* org )
         new->alphabet_len =  org->alphabet_len;
         new->num_states = org->num_states;
         new->max_seq_len = org->max_seq_len;
+        new->chain_loop = org->chain_loop;
+        new->scaled = org->scaled;
+        new->log_likelihood = 0.0;
+        new->em_iterations = 0;
         new->emissions = NULL;
         new->transitions = NULL;
 	
@@ -559,6 +990,20 @@ struct hmm* copy_hmm(struct hmm* org )
         new->B = NULL;
         new->F_memory = NULL;
         new->B_memory = NULL;
+        new->scale = NULL;
+        new->path_ck = NULL;
+        new->path_B = NULL;
+        new->path_e = NULL;
+        new->path_eb = NULL;
+        new->path_bb = NULL;
+        new->path_s = NULL;
+        new->path_t = NULL;
+        new->chain_block = 0;
+        new->path_block = 0;
+        new->lin_trans = NULL;
+        new->lin_emit = NULL;
+        new->count_trans = NULL;
+        new->count_emit = NULL;
 	
         new->tindex = NULL;
 	
@@ -567,15 +1012,14 @@ struct hmm* copy_hmm(struct hmm* org )
         MMALLOC(new->emissions_e,sizeof(float*) * org->num_states);
         MMALLOC(new->transitions_e,sizeof(float*) * org->num_states);
 	
-        MMALLOC(new->F_memory ,sizeof(float*) * org->num_states *org->max_seq_len );
-        MMALLOC(new->B_memory, sizeof(float*) * org->num_states * org->max_seq_len);
-	
-        MMALLOC(new->F ,sizeof(float*) * org->max_seq_len);
-        MMALLOC(new->B,sizeof(float*) * org->max_seq_len);
-	
-        for(i = 0; i < org->max_seq_len;i++){
-                new->F[i] = (float*) (new->F_memory + i *org->num_states);
-                new->B[i] = (float*) (new->B_memory + i *org->num_states);
+        MMALLOC(new->lin_trans, sizeof(float) * org->num_states * org->num_states);
+        MMALLOC(new->lin_emit, sizeof(float) * org->num_states * org->alphabet_len);
+        MMALLOC(new->count_trans, sizeof(double) * org->num_states * org->num_states);
+        MMALLOC(new->count_emit, sizeof(double) * org->num_states * org->alphabet_len);
+        if(org->chain_loop == -1){
+                RUN(alloc_dp_matrices(new));
+        }else{
+                RUN(alloc_chain_workspace(new));
         }
 	
 	
@@ -636,6 +1080,17 @@ struct hmm* forward(struct hmm* hmm, char* a, int len)
         const float* trans = 0;
 	
         float tmp = 0;
+
+        if(hmm->chain_loop != -1){
+                float score[HMM_LANES];
+                chain_load_path(hmm, len);
+                chain_forward(hmm, &a, 1, len, 1, score);
+                hmm->f_score = score[0];
+                return hmm;
+        }
+        if(hmm->scaled){
+                return forward_scaled(hmm, a, len);
+        }
 	
         cur = matrix[0];
 	
@@ -693,6 +1148,17 @@ struct hmm* backward(struct hmm* hmm, char* a, int len)
         float* next= 0;
         float* cur = 0;
         const float* trans = 0;
+
+        if(hmm->chain_loop != -1){
+                float score[HMM_LANES];
+                chain_load_path(hmm, len);
+                chain_backward(hmm, &a, 1, len, 1, score);
+                hmm->b_score = score[0];
+                return hmm;
+        }
+        if(hmm->scaled){
+                return backward_scaled(hmm, a, len);
+        }
 	
         cur = matrix[len+1];
 	
@@ -755,6 +1221,15 @@ struct hmm* collect_estimated(struct hmm* hmm, char* a,float weight, int len)
         const float* trans = 0;
 	
         float total = hmm->f_score + weight;
+
+        if(hmm->chain_loop != -1){
+                chain_load_path(hmm, len);
+                chain_collect_estimated(hmm, a, 0, total, len);
+                return hmm;
+        }
+        if(hmm->scaled){
+                return collect_scaled(hmm, a, weight, len);
+        }
 	
         for(i = 1; i < len+1;i++){
                 last_F = Fmatrix[i-1];
@@ -788,6 +1263,552 @@ struct hmm* collect_estimated(struct hmm* hmm, char* a,float weight, int len)
         return hmm;
 }
 
+/* Linear space variants of forward, backward and collect_estimated, used
+   when hmm->scaled is set. Every row of F and B is divided by the scaling
+   factor S_i = sum of the emitting forward values of row i (Rabiner), so
+   the values stay near one and no logsum is needed; the log likelihood is
+   the sum of log S_i. The probabilities come from lin_trans / lin_emit
+   (set_scaled_parameters) and the expected counts go to count_trans /
+   count_emit in double precision until add_scaled_estimates folds them
+   into transitions_e / emissions_e. The trained parameters agree with the
+   log space recursions within 1e-4 (checked in hmm_ITEST). */
+void set_scaled_parameters(struct hmm* hmm)
+{
+        const int N = hmm->num_states;
+        const int A = hmm->alphabet_len;
+        int i,j;
+
+        for(i = 0; i < N;i++){
+                for(j = 0; j < N;j++){
+                        hmm->lin_trans[i*N + j] = scaledprob2prob(hmm->transitions[i][j]);
+                        hmm->count_trans[i*N + j] = 0.0;
+                }
+                for(j = 0; j < A;j++){
+                        hmm->lin_emit[i*A + j] = i > 1 ? scaledprob2prob(hmm->emissions[i][j]) : 0.0f;
+                        hmm->count_emit[i*A + j] = 0.0;
+                }
+        }
+}
+
+void add_scaled_estimates(struct hmm* hmm)
+{
+        const int N = hmm->num_states;
+        const int A = hmm->alphabet_len;
+        int i,j;
+
+        for(i = 0; i < N;i++){
+                for(j = 0; j < N;j++){
+                        if(hmm->count_trans[i*N + j] > 0.0){
+                                hmm->transitions_e[i][j] = logsum(hmm->transitions_e[i][j], prob2scaledprob((float) hmm->count_trans[i*N + j]));
+                        }
+                        hmm->count_trans[i*N + j] = 0.0;
+                }
+                for(j = 0; j < A;j++){
+                        if(i > 1 && hmm->count_emit[i*A + j] > 0.0){
+                                hmm->emissions_e[i][j] = logsum(hmm->emissions_e[i][j], prob2scaledprob((float) hmm->count_emit[i*A + j]));
+                        }
+                        hmm->count_emit[i*A + j] = 0.0;
+                }
+        }
+}
+
+static struct hmm* forward_scaled(struct hmm* hmm, char* a, int len)
+{
+        const int N = hmm->num_states;
+        const int A = hmm->alphabet_len;
+        const float* T = hmm->lin_trans;
+        const float* E = hmm->lin_emit;
+        float* scale = hmm->scale;
+        float* last = 0;
+        float* cur = 0;
+        double score = 0.0;
+        float sum,tmp;
+        int i,j,c,f,x;
+
+        cur = hmm->F[0];
+        for(j = 0; j < N;j++){
+                cur[j] = 0.0f;
+        }
+        cur[STARTSTATE] = 1.0f;
+
+        for(i = 1; i < len+1;i++){
+                last = cur;
+                cur = hmm->F[i];
+                for(j = 0; j < N;j++){
+                        cur[j] = 0.0f;
+                }
+                for(j = 0; j < N;j++){
+                        tmp = last[j];
+                        for(c = 1; c < hmm->tindex[j][0];c++){
+                                f = hmm->tindex[j][c];
+                                cur[f] += tmp * T[j*N + f];
+                        }
+                }
+                x = (int) a[i-1];
+                sum = 0.0f;
+                for(c = 2;c < N;c++){
+                        cur[c] *= E[c*A + x];
+                        sum += cur[c];
+                }
+                if(sum == 0.0f){
+                        hmm->f_score = -INFINITY;
+                        return hmm;
+                }
+                scale[i] = sum;
+                score += log(sum);
+                sum = 1.0f / sum;
+                for(j = 0; j < N;j++){
+                        cur[j] *= sum;
+                }
+        }
+
+        last = cur;
+        cur = hmm->F[len+1];
+        for(j = 0; j < N;j++){
+                cur[j] = 0.0f;
+        }
+        sum = 0.0f;
+        for(j = 2; j < N;j++){
+                sum += last[j] * T[j*N + ENDSTATE];
+        }
+        if(sum == 0.0f){
+                hmm->f_score = -INFINITY;
+                return hmm;
+        }
+        scale[len+1] = sum;
+        cur[ENDSTATE] = 1.0f;
+        hmm->f_score = (float)(score + log(sum));
+        return hmm;
+}
+
+/* Uses the scaling factors of the preceding forward_scaled call. */
+static struct hmm* backward_scaled(struct hmm* hmm, char* a, int len)
+{
+        const int N = hmm->num_states;
+        const int A = hmm->alphabet_len;
+        const float* T = hmm->lin_trans;
+        const float* E = hmm->lin_emit;
+        const float* scale = hmm->scale;
+        float* next = 0;
+        float* cur = 0;
+        float sum,inv;
+        int i,j,c,f,x;
+
+        if(hmm->f_score == -INFINITY){
+                hmm->b_score = -INFINITY;
+                return hmm;
+        }
+
+        cur = hmm->B[len+1];
+        for(j = 0; j < N;j++){
+                cur[j] = 0.0f;
+        }
+        cur[ENDSTATE] = 1.0f / scale[len+1];
+
+        next = cur;
+        cur = hmm->B[len];
+        x = (int) a[len-1];
+        inv = 1.0f / scale[len];
+        for(j = 0; j < N;j++){
+                cur[j] = T[j*N + ENDSTATE] * next[ENDSTATE] * inv;
+        }
+        for(c = 2;c < N;c++){
+                cur[c] *= E[c*A + x];
+        }
+
+        for(i = len-1; i > 0; i--){
+                next = cur;
+                cur = hmm->B[i];
+                x = (int) a[i-1];
+                inv = 1.0f / scale[i];
+                for(j = 0; j < N;j++){
+                        sum = 0.0f;
+                        for(c = 1; c < hmm->tindex[j][0];c++){
+                                f = hmm->tindex[j][c];
+                                sum += T[j*N + f] * next[f];
+                        }
+                        cur[j] = sum * inv;
+                }
+                for(j = 2; j < N;j++){
+                        cur[j] *= E[j*A + x];
+                }
+        }
+
+        next = hmm->B[1];
+        sum = 0.0f;
+        for(i = 0; i < N;i++){
+                sum += T[i] * next[i];
+        }
+        hmm->b_score = prob2scaledprob(sum) + hmm->f_score;
+        return hmm;
+}
+
+/* F_i * B_i counts every path through row i once over S_i, so the
+   emission posteriors are multiplied back by S_i and divided by the
+   emission already contained in both F_i and B_i. */
+static struct hmm* collect_scaled(struct hmm* hmm, char* a,float weight, int len)
+{
+        const int N = hmm->num_states;
+        const int A = hmm->alphabet_len;
+        const float* T = hmm->lin_trans;
+        const float* E = hmm->lin_emit;
+        const float* scale = hmm->scale;
+        double* count_trans = hmm->count_trans;
+        double* count_emit = hmm->count_emit;
+        const float* last_F = 0;
+        const float* this_F = 0;
+        const float* this_B = 0;
+        double w,tmp;
+        int i,j,c,f,x;
+
+        if(hmm->f_score == -INFINITY){
+                return hmm;
+        }
+        w = exp(-weight);
+
+        for(i = 1; i < len+1;i++){
+                last_F = hmm->F[i-1];
+                this_F = hmm->F[i];
+                this_B = hmm->B[i];
+                x = (int) a[i-1];
+                for(j = 0; j < N;j++){
+                        tmp = last_F[j] * w;
+                        for(c = 1; c < hmm->tindex[j][0];c++){
+                                f = hmm->tindex[j][c];
+                                count_trans[j*N + f] += tmp * T[j*N + f] * this_B[f];
+                        }
+                        if(j > 1 && E[j*A + x] > 0.0f){
+                                count_emit[j*A + x] += (double) this_F[j] * this_B[j] * scale[i] / E[j*A + x] * w;
+                        }
+                }
+        }
+
+        last_F = hmm->F[len];
+        this_B = hmm->B[len+1];
+        for(j = 0; j < N;j++){
+                count_trans[j*N + ENDSTATE] += (double) last_F[j] * T[j*N + ENDSTATE] * this_B[ENDSTATE] * w;
+        }
+        return hmm;
+}
+
+/* Kernels for the composition HMMs made by init_samstat_hmm: a plain chain
+   START -> 2 -> ... -> num_states-1 -> END where only chain_loop has a self
+   loop. Such a chain admits exactly one state path for a sequence: state
+   i+1 emits residue i up to the loop state, the loop state emits the middle
+   and the last num_states-1-chain_loop residues go to the tail states. Every
+   other cell of F and B is -INFINITY (or does not reach the end) and adds
+   nothing in collect_estimated, so walking the path gives the same numbers
+   as the generic recursions in O(len) instead of O(len * edges) logsums.
+
+   Reads of the same length share that path, so forward and backward run
+   HMM_LANES of them in lockstep: path_e holds the emissions of one block of
+   chain_block rows with the lanes interleaved, and the per-row loop over
+   lanes has a fixed trip count the compiler can vectorise. Lanes past the
+   end of a short batch run on stale but finite values.
+
+   Only one block of rows is stored. Forward keeps just the current row;
+   backward leaves a checkpoint after every block, and collect walks the
+   blocks in order, carrying the forward value along and rebuilding the
+   backward rows of a block from its checkpoint unless they are still in
+   path_B - always the case for reads of up to chain_block residues. The
+   expected counts are still collected one read at a time, in input order,
+   with the same float operations as before, so the estimates do not
+   change. */
+static void chain_load_path(struct hmm* hmm,int len)
+{
+        int* state = hmm->path_s;
+        float* t = hmm->path_t;
+        float** trans = hmm->transitions;
+        const int loop = hmm->chain_loop;
+        const int last_state = hmm->num_states-1;
+        const int tail = last_state - loop;
+        int i,s;
+
+        if(len < hmm->num_states-2){
+                return;
+        }
+        state[0] = STARTSTATE;
+        for(i = 1; i < loop;i++){
+                state[i] = i+1;
+        }
+        for(; i <= len-tail;i++){
+                state[i] = loop;
+        }
+        for(s = loop+1; s <= last_state;s++,i++){
+                state[i] = s;
+        }
+        state[len+1] = ENDSTATE;
+        for(i = 1; i <= len+1;i++){
+                t[i] = trans[state[i-1]][state[i]];
+        }
+        hmm->path_block = 0;
+}
+
+/* Emissions of rows first..last of n reads, unless that block of the
+   current batch is already loaded. */
+static void chain_load_block(struct hmm* hmm,char** a,int n,int first,int last)
+{
+        const int* state = hmm->path_s;
+        float** emit = hmm->emissions;
+        float* e = hmm->path_e - first*HMM_LANES;
+        int i,r;
+
+        if(hmm->path_block == first){
+                return;
+        }
+        hmm->path_block = first;
+        for(r = 0; r < n;r++){
+                const char* seq = a[r] - 1;
+                for(i = first; i <= last;i++){
+                        e[i*HMM_LANES + r] = emit[state[i]][(int) seq[i]];
+                }
+        }
+}
+
+static inline void chain_row(float* restrict cur,const float* restrict prev,float t,const float* restrict e,int lanes)
+{
+        int r;
+        if(lanes == HMM_LANES){
+                for(r = 0; r < HMM_LANES;r++){
+                        cur[r] = prev[r] + t + e[r];
+                }
+        }else{
+                cur[0] = prev[0] + t + e[0];
+        }
+}
+
+static void chain_forward(struct hmm* hmm,char** a,int n,int len,int lanes,float* score)
+{
+        float F[2][HMM_LANES];
+        const float* e = hmm->path_e;
+        const float* t = hmm->path_t;
+        const int C = hmm->chain_block;
+        int i,r,first,last;
+
+        if(len < hmm->num_states-2){
+                for(r = 0; r < lanes;r++){
+                        score[r] = -INFINITY;
+                }
+                return;
+        }
+        for(r = 0; r < lanes;r++){
+                F[0][r] = 0.0f;
+        }
+        for(first = 1; first <= len;first += C){
+                last = first + C - 1;
+                if(last > len){
+                        last = len;
+                }
+                chain_load_block(hmm, a, n, first, last);
+                for(i = first; i <= last;i++){
+                        chain_row(F[i & 1], F[(i-1) & 1], t[i], e + (i-first)*HMM_LANES, lanes);
+                }
+        }
+        for(r = 0; r < lanes;r++){
+                score[r] = F[len & 1][r] + t[len+1];
+        }
+}
+
+/* Runs the blocks from the end: path_ck gets the backward row following
+   each block, path_B the rows of the block last done (the first one). */
+static void chain_backward(struct hmm* hmm,char** a,int n,int len,int lanes,float* score)
+{
+        float* B = hmm->path_B;
+        float* ck = hmm->path_ck;
+        const float* e = hmm->path_e;
+        const float* t = hmm->path_t;
+        const float* next = NULL;
+        const int C = hmm->chain_block;
+        int i,r,b,first,last;
+
+        if(len < hmm->num_states-2){
+                for(r = 0; r < lanes;r++){
+                        score[r] = -INFINITY;
+                }
+                return;
+        }
+        b = (len - 1) / C;
+        for(r = 0; r < lanes;r++){
+                ck[b*HMM_LANES + r] = 0.0f;
+        }
+        for(; b >= 0;b--){
+                first = b*C + 1;
+                last = first + C - 1;
+                if(last > len){
+                        last = len;
+                }
+                chain_load_block(hmm, a, n, first, last);
+                next = ck + b*HMM_LANES;
+                for(i = last; i >= first;i--){
+                        chain_row(B + (i-first)*HMM_LANES, next, t[i+1], e + (i-first)*HMM_LANES, lanes);
+                        next = B + (i-first)*HMM_LANES;
+                }
+                if(b){
+                        for(r = 0; r < lanes;r++){
+                                ck[(b-1)*HMM_LANES + r] = B[r];
+                        }
+                }
+        }
+        for(r = 0; r < lanes;r++){
+                score[r] = t[1] + B[r];
+        }
+}
+
+/* Adds the expected counts of read a in lane r of the last chain_backward;
+   total is its forward score plus the sequence weight. Backward rows of
+   blocks other than the one left in path_B are rebuilt from path_ck.
+   Scaled models take the counts in linear space. */
+static void chain_collect_estimated(struct hmm* hmm,const char* a,int r,float total,int len)
+{
+        const float* ck = hmm->path_ck + r;
+        float* eb = hmm->path_eb;
+        float* bb = hmm->path_bb;
+        const float* e = NULL;
+        const float* Bv = NULL;
+        const int* state = hmm->path_s;
+        const float* t = hmm->path_t;
+        const char* seq = a - 1;
+        float** emit = hmm->emissions;
+        float** trans_e = hmm->transitions_e;
+        float** emit_e = hmm->emissions_e;
+        const int N = hmm->num_states;
+        const int A = hmm->alphabet_len;
+        const int C = hmm->chain_block;
+        float F = 0.0f;
+        float F_last,B;
+        int i,j,p,s,c,first,last,stride;
+
+        if(len < hmm->num_states-2){
+                return;
+        }
+        for(first = 1; first <= len;first += C){
+                last = first + C - 1;
+                if(last > len){
+                        last = len;
+                }
+                if(hmm->path_block == first){
+                        e = hmm->path_e + r;
+                        Bv = hmm->path_B + r;
+                        stride = HMM_LANES;
+                }else{
+                        B = ck[(first / C) * HMM_LANES];
+                        for(i = last; i >= first;i--){
+                                j = i - first;
+                                eb[j] = emit[state[i]][(int) seq[i]];
+                                B = B + t[i+1] + eb[j];
+                                bb[j] = B;
+                        }
+                        e = eb;
+                        Bv = bb;
+                        stride = 1;
+                }
+                for(i = first; i <= last;i++){
+                        j = (i - first) * stride;
+                        p = state[i-1];
+                        s = state[i];
+                        c = seq[i];
+                        F_last = F;
+                        F = F + t[i] + e[j];
+                        if(hmm->scaled){
+                                hmm->count_trans[p*N + s] += exp(F_last + t[i] + Bv[j] - total);
+                                hmm->count_emit[s*A + c] += exp((F + (Bv[j] - e[j])) - total);
+                        }else{
+                                trans_e[p][s] = logsum(trans_e[p][s], F_last + t[i] + Bv[j] - total);
+                                emit_e[s][c] = logsum(emit_e[s][c], (F + (Bv[j] - e[j])) - total);
+                        }
+                }
+        }
+        s = state[len];
+        if(hmm->scaled){
+                hmm->count_trans[s*N + ENDSTATE] += exp(F + t[len+1] - total);
+        }else{
+                trans_e[s][ENDSTATE] = logsum(trans_e[s][ENDSTATE], F + t[len+1] - total);
+        }
+}
+
+/* One Baum-Welch step for n <= HMM_LANES reads that all have length len. */
+static void chain_baum_welch(struct hmm* hmm,char** a,const float* weight,int n,int len)
+{
+        float f_score[HMM_LANES];
+        float b_score[HMM_LANES];
+        int r;
+
+        const int lanes = n == 1 ? 1 : HMM_LANES;
+
+        chain_load_path(hmm, len);
+        chain_forward(hmm, a, n, len, lanes, f_score);
+        chain_backward(hmm, a, n, len, lanes, b_score);
+        for(r = 0; r < n;r++){
+                chain_collect_estimated(hmm, a[r], r, f_score[r] + weight[r], len);
+                if(f_score[r] != -INFINITY){
+                        hmm->log_likelihood += f_score[r];
+                }
+        }
+        hmm->f_score = f_score[n-1];
+        hmm->b_score = b_score[n-1];
+}
+
+struct hmm_read{
+        char* string;
+        int length;
+        float weight;
+        int id;
+};
+
+static int qsort_hmm_read_cmp(const void *a, const void *b)
+{
+        const struct hmm_read* ra = (const struct hmm_read*) a;
+        const struct hmm_read* rb = (const struct hmm_read*) b;
+        if(ra->length != rb->length){
+                return ra->length < rb->length ? -1 : 1;
+        }
+        return ra->id - rb->id;
+}
+
+/* Sorts reads start .. end-1 of data by length, keeping the order of equal
+   lengths, so that chain_batch_size finds runs to fill the lanes with. */
+int sort_hmm_data_by_length(struct hmm_data* data,int start,int end)
+{
+        struct hmm_read* reads = NULL;
+        int i;
+
+        if(end - start < 2){
+                return OK;
+        }
+        MMALLOC(reads, sizeof(struct hmm_read) * (end - start));
+        for(i = start; i < end;i++){
+                reads[i - start].string = data->string[i];
+                reads[i - start].length = data->length[i];
+                reads[i - start].weight = data->weight[i];
+                reads[i - start].id = i;
+        }
+        qsort(reads, end - start, sizeof(struct hmm_read), qsort_hmm_read_cmp);
+        for(i = start; i < end;i++){
+                data->string[i] = reads[i - start].string;
+                data->length[i] = reads[i - start].length;
+                data->weight[i] = reads[i - start].weight;
+        }
+        MFREE(reads);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Number of reads from first that go into one batch: the run of equal
+   lengths (at most HMM_LANES), or 1 if the run is too short to be worth
+   filling the lanes - then the single lane kernels are cheaper. */
+static int chain_batch_size(struct hmm_data* data,int first,int end)
+{
+        int n = 1;
+        while(n < HMM_LANES && first + n < end && data->length[first + n] == data->length[first]){
+                n++;
+        }
+        if(n < HMM_LANES / 2){
+                n = 1;
+        }
+        return n;
+}
+
 /*
   float logsub(const float a,const float b)
   {
@@ -826,7 +1847,7 @@ int main (int argc,char * argv[])
 	
         //struct hmm* hmm = malloc_hmm(len,4);
 	
-        int i,j;
+        int i,j,c;
 	
         init_logsum();
 	
@@ -873,7 +1894,197 @@ int main (int argc,char * argv[])
         fprintf(stderr,"Forward:\t%f\nBackward:\t%f\n", hmm->f_score, hmm->b_score);
 	
         fprintf(stderr,"%f time\n", cpu_time_used);
-        
+        free_hmm(hmm);
+
+        /* chain kernels against the generic recursions */
+        struct hmm* chain = NULL;
+        RUNP(hmm = chain_hmm(13, 502, 0));
+        RUNP(chain = chain_hmm(13, 502, 1));
+        srand(42);
+        for(i = 0; i < len;i++){
+                test_seq[i] = rand() % 5;
+        }
+        for(j = 11; j < len;j += 61){
+                hmm = forward(hmm,test_seq,j);
+                hmm = backward(hmm,test_seq,j);
+                hmm = collect_estimated(hmm,test_seq,0.0f, j);
+                chain = forward(chain,test_seq,j);
+                chain = backward(chain,test_seq,j);
+                chain = collect_estimated(chain,test_seq,0.0f, j);
+                ASSERT(hmm->f_score == chain->f_score, "Chain forward differs: %f %f (len %d)", hmm->f_score, chain->f_score,j);
+                ASSERT(hmm->b_score == chain->b_score, "Chain backward differs: %f %f (len %d)", hmm->b_score, chain->b_score,j);
+        }
+
+        /* batches: runs of equal length longer and shorter than HMM_LANES */
+        struct hmm_data batch;
+        struct thread_data td;
+        char* seqs[40];
+        int lengths[40];
+        float weights[40];
+        for(i = 0; i < 40;i++){
+                seqs[i] = test_seq + (i * 7) % 100;
+                lengths[i] = i < 3 ? 11 : (i < 15 ? 60 : 20 + i);
+                weights[i] = prob2scaledprob(1.0f / (float)(1 + i % 4));
+                hmm = forward(hmm,seqs[i],lengths[i]);
+                hmm = backward(hmm,seqs[i],lengths[i]);
+                hmm = collect_estimated(hmm,seqs[i],weights[i], lengths[i]);
+        }
+        batch.string = seqs;
+        batch.length = lengths;
+        batch.weight = weights;
+        batch.num_seq = 40;
+        td.hmm = chain;
+        td.data = &batch;
+        td.start = 0;
+        td.end = 40;
+        do_baum_welch(&td);
+
+        for(i = 0; i < hmm->num_states;i++){
+                for(c = 0; c < hmm->num_states;c++){
+                        ASSERT(hmm->transitions_e[i][c] == chain->transitions_e[i][c], "Chain transition estimate %d->%d differs.",i,c);
+                }
+        }
+        for(i = 2; i < hmm->num_states;i++){
+                for(c = 0; c < hmm->alphabet_len;c++){
+                        ASSERT(hmm->emissions_e[i][c] == chain->emissions_e[i][c], "Chain emission estimate %d:%d differs.",i,c);
+                }
+        }
+        fprintf(stderr,"Chain kernels match the generic recursions.\n");
+        free_hmm(hmm);
+        free_hmm(chain);
+
+        /* the same reads in random order fill few lanes until sorted by
+           length; the counts only change by the order of the sums */
+        struct hmm_data shuffled;
+        char* shuf_seqs[40];
+        int shuf_lengths[40];
+        float shuf_weights[40];
+        int lane_reads[2];
+        char* tmp_seq;
+        float tmp_weight;
+        float diff;
+        for(i = 0; i < 40;i++){
+                shuf_seqs[i] = seqs[i];
+                shuf_lengths[i] = lengths[i];
+                shuf_weights[i] = weights[i];
+        }
+        for(i = 39; i > 0;i--){
+                j = rand() % (i + 1);
+                tmp_seq = shuf_seqs[i];
+                shuf_seqs[i] = shuf_seqs[j];
+                shuf_seqs[j] = tmp_seq;
+                c = shuf_lengths[i];
+                shuf_lengths[i] = shuf_lengths[j];
+                shuf_lengths[j] = c;
+                tmp_weight = shuf_weights[i];
+                shuf_weights[i] = shuf_weights[j];
+                shuf_weights[j] = tmp_weight;
+        }
+        shuffled.string = shuf_seqs;
+        shuffled.length = shuf_lengths;
+        shuffled.weight = shuf_weights;
+        shuffled.num_seq = 40;
+        RUNP(hmm = chain_hmm(13, 502, 1));
+        RUNP(chain = chain_hmm(13, 502, 1));
+        td.data = &shuffled;
+        for(c = 0; c < 2;c++){
+                lane_reads[c] = 0;
+                for(i = 0; i < 40;i += j){
+                        j = chain_batch_size(&shuffled, i, 40);
+                        if(j > 1){
+                                lane_reads[c] += j;
+                        }
+                }
+                td.hmm = c ? chain : hmm;
+                do_baum_welch(&td);
+                if(c == 0){
+                        RUN(sort_hmm_data_by_length(&shuffled, 0, 40));
+                }
+        }
+        td.data = &batch;
+        diff = 0.0f;
+        for(i = 2; i < hmm->num_states;i++){
+                for(c = 0; c < hmm->alphabet_len;c++){
+                        diff = fmaxf(diff, fabsf(hmm->emissions_e[i][c] - chain->emissions_e[i][c]));
+                }
+        }
+        fprintf(stderr,"Shuffled lengths: %d of 40 reads in lane batches, %d after sorting; max estimate difference %e\n", lane_reads[0], lane_reads[1], diff);
+        ASSERT(lane_reads[1] > lane_reads[0], "Sorting did not bring back runs of equal length.");
+        ASSERT(diff < 1e-4f, "Sorted batch estimates differ: %e", diff);
+        free_hmm(hmm);
+        free_hmm(chain);
+
+        /* linear space scaling against log space, generic and chain models */
+        for(i = 0; i < len;i++){
+                test_seq[i] = rand() % 4;
+        }
+        RUNP(hmm = complicated_hmm());
+        diff = scaled_training_difference(hmm, &td, 10);
+        fprintf(stderr,"Scaled vs log space (generic): max emission difference %e\n", diff);
+        ASSERT(diff < 1e-4f, "Scaled training differs: %e", diff);
+        free_hmm(hmm);
+
+        RUNP(hmm = chain_hmm(13, 502, 1));
+        diff = scaled_training_difference(hmm, &td, 10);
+        fprintf(stderr,"Scaled vs log space (chain): max emission difference %e\n", diff);
+        ASSERT(diff < 1e-4f, "Scaled training differs: %e", diff);
+        free_hmm(hmm);
+
+        /* EM stops once the likelihood settles */
+        RUNP(hmm = chain_hmm(13, 502, 1));
+        batch.num_threads = 1;
+        batch.iterations = 20;
+        batch.tolerance = 1e-4f;
+        batch.pool = NULL;
+        batch.workers = NULL;
+        batch.num_workers = 0;
+        batch.batches = NULL;
+        batch.num_batches = 0;
+        batch.alloc_batches = 0;
+        batch.batch_est = NULL;
+        batch.alloc_est = 0;
+        RUN(run_EM_iterations(hmm, &batch));
+        fprintf(stderr,"EM: %d iterations, log likelihood %f\n", hmm->em_iterations, hmm->log_likelihood);
+        ASSERT(hmm->em_iterations > 1 && hmm->em_iterations < batch.iterations, "EM did not converge: %d iterations.", hmm->em_iterations);
+        ASSERT(isfinite(hmm->log_likelihood) && hmm->log_likelihood < 0.0, "Bad log likelihood: %f", hmm->log_likelihood);
+        free_hmm(hmm);
+
+        /* two models trained together match separate runs up to the
+           order in which the slices are summed */
+        struct hmm* pair[2];
+        int pair_start[3] = {0, 15, 40};
+        RUNP(hmm = chain_hmm(13, 502, 1));
+        RUNP(chain = chain_hmm(13, 502, 1));
+        RUNP(pair[0] = chain_hmm(13, 502, 1));
+        RUNP(pair[1] = chain_hmm(13, 502, 1));
+        batch.num_seq = 15;
+        RUN(run_EM_iterations(hmm, &batch));
+        batch.string = seqs + 15;
+        batch.length = lengths + 15;
+        batch.weight = weights + 15;
+        batch.num_seq = 25;
+        RUN(run_EM_iterations(chain, &batch));
+        batch.string = seqs;
+        batch.length = lengths;
+        batch.weight = weights;
+        batch.num_seq = 40;
+        RUN(run_EM_models(pair, 2, pair_start, &batch));
+        ASSERT(pair[0]->em_iterations == hmm->em_iterations && pair[1]->em_iterations == chain->em_iterations, "Joint training ran a different number of rounds.");
+        diff = 0.0f;
+        for(i = 2; i < hmm->num_states;i++){
+                for(c = 0; c < hmm->alphabet_len;c++){
+                        diff = fmaxf(diff, fabsf(scaledprob2prob(pair[0]->emissions[i][c]) - scaledprob2prob(hmm->emissions[i][c])));
+                        diff = fmaxf(diff, fabsf(scaledprob2prob(pair[1]->emissions[i][c]) - scaledprob2prob(chain->emissions[i][c])));
+                }
+        }
+        fprintf(stderr,"Joint EM: %d and %d iterations, max emission difference to separate runs %e\n", pair[0]->em_iterations, pair[1]->em_iterations, diff);
+        ASSERT(diff < 1e-4f, "Joint training differs: %e", diff);
+        free_hmm(pair[0]);
+        free_hmm(pair[1]);
+        free_hmm(chain);
+        free_hmm_workers(&batch);
+        free_hmm(hmm);
+        MFREE(test_seq);
         return EXIT_SUCCESS;       
 ERROR:
         return EXIT_FAILURE;
@@ -881,6 +2092,41 @@ ERROR:
 
 
 
+/* Trains a copy of hmm in log space and one with per-row scaling on the
+   sequences in td for the given number of EM iterations and returns the
+   largest difference between their emission probabilities. */
+float scaled_training_difference(struct hmm* hmm,struct thread_data* td,int iterations)
+{
+        struct hmm* scaled = NULL;
+        float diff = 0.0f;
+        float d;
+        int i,j,c;
+
+        RUNP(scaled = copy_hmm(hmm));
+        scaled->scaled = 1;
+        for(i = 0; i < iterations;i++){
+                td->hmm = hmm;
+                do_baum_welch(td);
+                RUN(reestimate_hmm_parameters(hmm));
+                td->hmm = scaled;
+                do_baum_welch(td);
+                RUN(reestimate_hmm_parameters(scaled));
+        }
+        for(j = 2; j < hmm->num_states;j++){
+                for(c = 0; c < hmm->alphabet_len;c++){
+                        d = fabsf(scaledprob2prob(hmm->emissions[j][c]) - scaledprob2prob(scaled->emissions[j][c]));
+                        if(d > diff){
+                                diff = d;
+                        }
+                }
+        }
+        free_hmm(scaled);
+        return diff;
+ERROR:
+        free_hmm(scaled);
+        return INFINITY;
+}
+
 struct hmm* complicated_hmm(void)
 {
         struct hmm* hmm = malloc_hmm(14, 4,1000);
@@ -1007,6 +2253,59 @@ ERROR:
 }
 
 
+/* Same topology as init_samstat_hmm in main.c, with uneven emissions;
+   kernels selects the chain kernels instead of the generic recursions. */
+struct hmm* chain_hmm(int num_states,int max_seq_len,int kernels)
+{
+        struct hmm* hmm = NULL;
+        const int loop = (num_states - 2) / 2 + 2;
+        int i,j,c;
+
+        RUNP(hmm = malloc_hmm(num_states, 5, max_seq_len));
+
+        for(i = 0; i < hmm->num_states;i++){
+                for(j = 0; j < hmm->num_states;j++){
+                        hmm->transitions[i][j] = -INFINITY;
+                        hmm->transitions_e[i][j] = -INFINITY;
+                }
+        }
+        hmm->transitions[STARTSTATE][2] = prob2scaledprob(1.0f);
+        for(i = 2; i < hmm->num_states-1;i++){
+                hmm->transitions[i][i+1] = prob2scaledprob(1.0f);
+        }
+        hmm->transitions[hmm->num_states-1][ENDSTATE] = prob2scaledprob(1.0f);
+        hmm->transitions[loop][loop] = prob2scaledprob(0.8f);
+        hmm->transitions[loop][loop+1] = prob2scaledprob(0.2f);
+
+        for(i = 1; i < hmm->num_states;i++){
+                MMALLOC(hmm->emissions[i], sizeof(float) * hmm->alphabet_len);
+                MMALLOC(hmm->emissions_e[i], sizeof(float) * hmm->alphabet_len);
+                for(j = 0;j < hmm->alphabet_len;j++){
+                        hmm->emissions[i][j] = prob2scaledprob((float)(1 + (i + j) % 3) / 10.0f);
+                        hmm->emissions_e[i][j] = prob2scaledprob(0.5f);
+                }
+        }
+
+        for(i = 0; i < hmm->num_states;i++){
+                c = 0;
+                for(j = 0; j < hmm->num_states;j++){
+                        if(hmm->transitions[i][j]  != -INFINITY){
+                                hmm->tindex[i][c+1] = j;
+                                hmm->transitions_e[i][j] = prob2scaledprob(0.5f);
+                                c++;
+                        }
+                }
+                hmm->tindex[i][0] = c+1;
+        }
+        if(kernels){
+                RUN(set_chain_model(hmm, loop));
+        }
+        return hmm;
+ERROR:
+        free_hmm(hmm);
+        return NULL;
+}
+
 void print_max_posterior(struct hmm* hmm, char* a, int len)
 {
         int i,j,c;
@@ -10,6 +10,10 @@
 #define MODE_BAUM_WELCH 0
 #define MODE_FORWARD 1
 
+#define HMM_LANES 8 /* reads evaluated in lockstep by the chain kernels */
+#define HMM_CHAIN_BLOCK 256 /* minimum rows between backward checkpoints of the chain kernels */
+#define HMM_BATCHES_PER_THREAD 16 /* batches of reads per thread and pass; threads pull them as they go */
+
 
 struct hmm{
         float** transitions;
@@ -22,15 +26,34 @@ struct hmm{
 	
         float* F_memory;
         float* B_memory;
+        float* scale;/**< @brief Scaled models: forward scaling factor of each row. */
+
+        float* path_ck;/**< @brief Chain models: backward value after every chain_block rows, HMM_LANES reads interleaved. */
+        float* path_B;/**< @brief Backward rows of one block, interleaved like path_ck. */
+        float* path_e;/**< @brief Emission of each residue of one block by its path state, interleaved like path_ck. */
+        float* path_eb;/**< @brief Single read emissions of one block (collect). */
+        float* path_bb;/**< @brief Single read backward values of one block (collect). */
+        int* path_s;/**< @brief Path state of each row for the current batch length. */
+        float* path_t;/**< @brief Transition into the path state of each row (row len+1 = END). */
+        int chain_block;
+        int path_block;/**< @brief First row of the block held in path_e (and path_B after chain_backward); 0 = none. */
+
+        float* lin_trans;/**< @brief Scaled models: transitions as probabilities, num_states x num_states. */
+        float* lin_emit;/**< @brief Scaled models: emissions as probabilities, num_states x alphabet_len. */
+        double* count_trans;/**< @brief Scaled models: expected transition counts of the current run. */
+        double* count_emit;
 	
         void* data;
 	
         float f_score;
         float b_score;
+        double log_likelihood;/**< @brief Sum of the forward scores of the last Baum-Welch run. */
+        int em_iterations;/**< @brief Rounds done by the last run_EM_iterations. */
         int num_states;
         int alphabet_len;
         int max_seq_len;
-	
+        int chain_loop;/**< @brief Self loop state of a chain model (see set_chain_model); -1 = use the generic tindex recursions. */
+        int scaled;/**< @brief 1 = run the recursions in linear space with per-row scaling instead of log space. */
 };
 
 
@@ -42,7 +65,25 @@ struct hmm_data{
         float* weight;
         int num_threads;
         int run_mode;
-        int iterations;
+        int iterations;/**< @brief Maximum number of EM rounds. */
+        float tolerance;/**< @brief EM stops when the log likelihood improves by less than this fraction. */
+        thr_pool_t* pool;/**< @brief Worker threads; created on the first run and kept until free_hmm_workers. */
+        struct thread_data* workers;/**< @brief One workspace HMM per thread and model, reused across runs. */
+        int num_workers;/**< @brief Number of workspaces allocated so far. */
+        struct hmm_batch* batches;/**< @brief Reads of the current pass, cut up for the threads to pull. */
+        int num_batches;
+        int alloc_batches;
+        int next_batch;/**< @brief Next batch to hand out; shared by the threads. */
+        float* batch_est;/**< @brief Expected counts of each batch, merged in batch order after the pass. */
+        int alloc_est;
+};
+
+struct hmm_batch{
+        int start;
+        int end;
+        int model;
+        int est;/**< @brief Offset of the batch's counts in hmm_data->batch_est. */
+        double log_likelihood;
 };
 
 
@@ -58,10 +99,13 @@ struct thread_data{
 
 /* convenience fiunctions */
 int run_EM_iterations (struct hmm* hmm,struct hmm_data* data);
+int run_EM_models(struct hmm** hmms,int num_hmm,const int* start,struct hmm_data* data);
+int sort_hmm_data_by_length(struct hmm_data* data,int start,int end);
 
 /* Main driver functions */
 
 int run_pHMM(struct hmm* hmm,struct hmm_data* data);
+void free_hmm_workers(struct hmm_data* data);
 void* do_baum_welch(void *threadarg);
 void* do_forward(void *threadarg);
 
@@ -70,11 +114,15 @@ struct hmm* backward(struct hmm* hmm, char* a, int len);
 struct hmm* forward(struct hmm* hmm, char* a, int len);
 struct hmm* collect_estimated(struct hmm* hmm, char* a,float weight, int len);
 int reestimate_hmm_parameters(struct hmm* hmm);
+void set_scaled_parameters(struct hmm* hmm);
+void add_scaled_estimates(struct hmm* hmm);
 
 
 /* hmm manipulations */
 struct hmm* copy_hmm(struct hmm* org);
+struct hmm* copy_hmm_parameters(struct hmm* target,struct hmm* org);
 struct hmm* copy_estimated_parameters(struct hmm* target,struct hmm* source );
+int set_chain_model(struct hmm* hmm,int loop);
 
 /* printing */
 void print_dyn_matrix(struct hmm* hmm, int seq_len);
@@ -95,6 +143,8 @@ struct hmm* init_hmm_simple_ID(struct hmm* hmm);
 #include <time.h>
 
 struct hmm* complicated_hmm(void);
+struct hmm* chain_hmm(int num_states,int max_seq_len,int kernels);
+float scaled_training_difference(struct hmm* hmm,struct thread_data* td,int iterations);
 void print_max_posterior(struct hmm* hmm, char* a, int len);
 #endif
 
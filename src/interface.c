@@ -32,17 +32,32 @@ struct parameters* interface(int argc, char *argv[])
         param->messages = NULL;
         param->filter = 0;
         param->local_out = 0;
+        param->reference = NULL;
+        param->contigs = NULL;
+        param->mapq_bounds[0] = 3;
+        param->mapq_bounds[1] = 10;
+        param->mapq_bounds[2] = 20;
+        param->mapq_bounds[3] = 30;
+        param->tiles = NULL;
+        param->tile_stats = 0;
+        param->hmm_sample = 100000;
+        param->hmm_sample_mem = 300;
 	
         while (1){	 
                 static struct option long_options[] ={
                         {"help",0,0,'h'},
                         {"version",0,0,'v'},
                         {"log",required_argument,0,'l'},
+                        {"ref",required_argument,0,'r'},
+                        {"mapq",required_argument,0,'m'},
+                        {"tiles",0,0,'t'},
+                        {"sample",required_argument,0,'a'},
+                        {"samplemem",required_argument,0,'b'},
                         {0, 0, 0, 0}
                 };
 		
                 int option_index = 0;
-                c = getopt_long_only (argc, argv,"hvl",long_options, &option_index);
+                c = getopt_long_only (argc, argv,"hvlr:m:ta:b:",long_options, &option_index);
 		
                 if (c == -1){
                         break;
@@ -65,6 +80,34 @@ struct parameters* interface(int argc, char *argv[])
                 case 'l':
                         param->local_out = 1;
                         break;
+                case 'r':
+                        param->reference = optarg;
+                        break;
+                case 't':
+                        param->tile_stats = 1;
+                        break;
+                case 'a':
+                        param->hmm_sample = atoi(optarg);
+                        if(param->hmm_sample < 1 || param->hmm_sample > 1000000){
+                                ERROR_MSG("-sample expects a number of reads between 1 and 1000000, got: %s",optarg);
+                        }
+                        break;
+                case 'b':
+                        param->hmm_sample_mem = atoi(optarg);
+                        if(param->hmm_sample_mem < 1 || param->hmm_sample_mem > 65536){
+                                ERROR_MSG("-samplemem expects a number of megabytes between 1 and 65536, got: %s",optarg);
+                        }
+                        break;
+                case 'm':
+                        if(sscanf(optarg,"%d,%d,%d,%d",&param->mapq_bounds[0],&param->mapq_bounds[1],&param->mapq_bounds[2],&param->mapq_bounds[3]) != 4){
+                                ERROR_MSG("-mapq expects four comma separated boundaries (e.g. 3,10,20,30), got: %s",optarg);
+                        }
+                        for(i = 0; i < 4;i++){
+                                if(param->mapq_bounds[i] < 2 || param->mapq_bounds[i] > 255 || (i && param->mapq_bounds[i] <= param->mapq_bounds[i-1])){
+                                        ERROR_MSG("-mapq boundaries must be increasing and between 2 and 255, got: %s",optarg);
+                                }
+                        }
+                        break;
                 case '?':
                         exit(1);
                         break;
@@ -156,6 +199,13 @@ void usage()
         fprintf(stdout, "SAMstat will produce a summary file (html) for each input file named\n <original filename>.samstat.html.\n");
 	
         fprintf(stdout, "\n");
+        fprintf(stdout, "Options:\n");
+        fprintf(stdout, "   -ref <file.fa>   Reference sequences; used to derive mismatches for reads without MD tags.\n");
+        fprintf(stdout, "   -mapq <a,b,c,d>  MAPQ class boundaries: 0, 1..a-1, a..b-1, b..c-1, c..d-1, >= d [3,10,20,30].\n");
+        fprintf(stdout, "   -tiles           Per tile quality and error rates from Casava 1.8 read names.\n");
+        fprintf(stdout, "   -sample <n>      Reads per MAPQ group sampled across the whole file to train the HMMs [100000].\n");
+        fprintf(stdout, "   -samplemem <MB>  Memory for the sampled reads of all three groups; fewer reads are kept if they do not fit [300].\n");
+        fprintf(stdout, "\n");
 	
 }
 
@@ -2,6 +2,7 @@
 #include "misc.h"
 
 #include "io.h"
+#include "contig.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -118,9 +119,9 @@ FILE* io_handler(FILE* file, int file_num,struct parameters* param)
                 if(param->sam == 2){
                         command[0] = 0;
                         if(!param->filter){
-                                strcat ( command, "samtools view -F 768 "); 
+                                strcat ( command, "samtools view -h -F 768 "); 
                         }else{
-                                strcat ( command, "samtools view -F "); 
+                                strcat ( command, "samtools view -h -F "); 
                                 sprintf (tmp, "%s ",param->filter);
                                 strcat ( command, tmp);
                         }
@@ -135,9 +136,9 @@ FILE* io_handler(FILE* file, int file_num,struct parameters* param)
                 }else if(param->sam == 1){
                         command[0] = 0;
                         if(!param->filter){
-                                strcat ( command, "samtools view -SF 768 "); 
+                                strcat ( command, "samtools view -h -SF 768 "); 
                         }else{
-                                strcat ( command, "samtools view -SF "); 
+                                strcat ( command, "samtools view -h -SF "); 
                                 sprintf (tmp, "%s ",param->filter);
                                 strcat ( command, tmp);
                         }
@@ -159,10 +160,10 @@ FILE* io_handler(FILE* file, int file_num,struct parameters* param)
                         if(param->bzipped){
                                 strcat ( command, "bzcat ");
                                 if(!param->filter){
-                                        sprintf (tmp, "%s | samtools view -F 768 - ", param->infile[file_num]);
+                                        sprintf (tmp, "%s | samtools view -h -F 768 - ", param->infile[file_num]);
                                         strcat ( command, tmp);
                                 }else{
-                                        sprintf (tmp, "%s | samtools view -F  ", param->infile[file_num]);
+                                        sprintf (tmp, "%s | samtools view -h -F  ", param->infile[file_num]);
                                         strcat ( command, tmp);
                                         sprintf (tmp, "%s - ",param->filter);
                                         strcat ( command, tmp);
@@ -175,19 +176,19 @@ FILE* io_handler(FILE* file, int file_num,struct parameters* param)
                                         strcat ( command, "zcat "); 
                                 }
                                 if(!param->filter){
-                                        sprintf (tmp, "%s | samtools view -F 768 - ", param->infile[file_num]);
+                                        sprintf (tmp, "%s | samtools view -h -F 768 - ", param->infile[file_num]);
                                         strcat ( command, tmp);
                                 }else{
-                                        sprintf (tmp, "%s | samtools view -F  ", param->infile[file_num]);
+                                        sprintf (tmp, "%s | samtools view -h -F  ", param->infile[file_num]);
                                         strcat ( command, tmp);
                                         sprintf (tmp, "%s - ",param->filter);
                                         strcat ( command, tmp);
                                 }
                         }else{
                                 if(!param->filter){
-                                        strcat ( command, "samtools view -F 768 "); 
+                                        strcat ( command, "samtools view -h -F 768 "); 
                                 }else{
-                                        strcat ( command, "samtools view -F "); 
+                                        strcat ( command, "samtools view -h -F "); 
                                         sprintf (tmp, "%s ",param->filter);
                                         strcat ( command, tmp);
                                 }
@@ -209,19 +210,19 @@ FILE* io_handler(FILE* file, int file_num,struct parameters* param)
                                         strcat ( command, "zcat "); 
                                 }
                                 if(!param->filter){
-                                        sprintf (tmp, "%s | samtools view -SF 768 - ", param->infile[file_num]);
+                                        sprintf (tmp, "%s | samtools view -h -SF 768 - ", param->infile[file_num]);
                                         strcat ( command, tmp);
                                 }else{
-                                        sprintf (tmp, "%s | samtools view -SF  ", param->infile[file_num]);
+                                        sprintf (tmp, "%s | samtools view -h -SF  ", param->infile[file_num]);
                                         strcat ( command, tmp);
                                         sprintf (tmp, "%s - ",param->filter);
                                         strcat ( command, tmp);
                                 }
                         }else{
                                 if(!param->filter){
-                                        strcat ( command, "samtools view -SF 768 "); 
+                                        strcat ( command, "samtools view -h -SF 768 "); 
                                 }else{
-                                        strcat ( command, "samtools view -SF "); 
+                                        strcat ( command, "samtools view -h -SF "); 
                                         sprintf (tmp, "%s ",param->filter);
                                         strcat ( command, tmp);
                                 }
@@ -265,6 +266,73 @@ FILE* io_handler(FILE* file, int file_num,struct parameters* param)
 
 
 
+/* Interns SN: of a @SQ header line together with its LN:; lines without
+   SN: are skipped with a warning. */
+static int read_sq_header_line(struct parameters* param,char* line)
+{
+        char* sn = NULL;
+        char* ln = NULL;
+        int sn_len = 0;
+        int id;
+
+        sn = strstr(line, "\tSN:");
+        if(!sn){
+                sprintf(param->buffer,"WARNING: Skipped @SQ header line without SN: field.\n");
+                param->messages = append_message(param->messages, param->buffer);
+                return OK;
+        }
+        sn += 4;
+        while(sn[sn_len] && !isspace((int)sn[sn_len])){
+                sn_len++;
+        }
+        ln = strstr(line, "\tLN:");
+        id = contig_table_intern(param->contigs, sn, sn_len, ln ? atoi(ln + 4) : 0);
+        ASSERT(id != -1, "Could not store reference name of header line: %s",line);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Casava 1.8 read names are instrument:run:flowcell:lane:tile:x:y; interns
+   flowcell:lane:tile and sets tile to its ID, or to -1 if the name does not
+   have this form. */
+static int read_tile(struct contig_table* ct,const char* name,int* tile)
+{
+        int colon[6];
+        int n = 0;
+        int i,j;
+
+        *tile = -1;
+        for(i = 0; name[i] && !isspace((int)name[i]);i++){
+                if(name[i] == ':'){
+                        if(n == 6){
+                                return OK;
+                        }
+                        colon[n] = i;
+                        n++;
+                }
+        }
+        if(n != 6){
+                return OK;
+        }
+        /* lane and tile have to be numbers */
+        for(j = 2; j < 4;j++){
+                if(colon[j+1] == colon[j] + 1){
+                        return OK;
+                }
+                for(i = colon[j] + 1; i < colon[j+1];i++){
+                        if(!isdigit((int)name[i])){
+                                return OK;
+                        }
+                }
+        }
+        *tile = contig_table_intern(ct, name + colon[1] + 1, colon[4] - colon[1] - 1, 0);
+        ASSERT(*tile != -1, "Could not store tile of read: %s",name);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
 int read_sam_chunk(struct read_info** ri,struct parameters* param,FILE* file)
 {
         //char line[MAX_LINE];
@@ -299,6 +367,9 @@ int read_sam_chunk(struct read_info** ri,struct parameters* param,FILE* file)
                                 }
                                 ri[c]->name[j] = line[j];
                         }
+                        if(param->tiles){
+                                RUN(read_tile(param->tiles, ri[c]->name, &ri[c]->tile));
+                        }
 			
                         for(i = 0; i < read;i++){
                                 if(line[i] == '\n'){
@@ -309,7 +380,8 @@ int read_sam_chunk(struct read_info** ri,struct parameters* param,FILE* file)
                                         switch(column){
                                         case 2: // <FLAG>
                                                 tmp = atoi(line+i+1);
-                                                ri[i]->strand = (tmp & 0x10);
+                                                ri[c]->flag = tmp;
+                                                ri[c]->strand = (tmp & 0x10);
 
                                                 //WARNING - read should be reverse complemented if mapped to negative strand before tagdusting...
 							
@@ -324,10 +396,19 @@ int read_sam_chunk(struct read_info** ri,struct parameters* param,FILE* file)
 							
                                                 break;
                                         case 3: // <RNAME> 
-							
+                                                tmp = 0;
+                                                for(j = i+1;j < read;j++){
+                                                        if(isspace((int)line[j])){
+                                                                break;
+                                                        }
+                                                        tmp++;
+                                                }
+                                                if(param->contigs && !(tmp == 1 && line[i+1] == '*')){
+                                                        ri[c]->contig = contig_table_intern(param->contigs, line+i+1, tmp, 0);
+                                                }
                                                 break;
                                         case 4: // <POS>
-							
+                                                ri[c]->pos = atoi(line+i+1);
                                                 break;
                                         case 5: //  <MAPQ>
 							
@@ -355,10 +436,24 @@ int read_sam_chunk(struct read_info** ri,struct parameters* param,FILE* file)
                                                 }
                                                 break;
                                         case 7: //  <MRNM>
+                                                tmp = 0;
+                                                for(j = i+1;j < read;j++){
+                                                        if(isspace((int)line[j])){
+                                                                break;
+                                                        }
+                                                        tmp++;
+                                                }
+                                                if(tmp == 1 && line[i+1] == '='){
+                                                        ri[c]->mcontig = ri[c]->contig;
+                                                }else if(param->contigs && !(tmp == 1 && line[i+1] == '*')){
+                                                        ri[c]->mcontig = contig_table_intern(param->contigs, line+i+1, tmp, 0);
+                                                }
                                                 break;
                                         case 8: //  <MPOS>
+                                                ri[c]->mpos = atoi(line+i+1);
                                                 break;
                                         case 9: //  <ISIZE>
+                                                ri[c]->isize = atoi(line+i+1);
                                                 break;
                                         case 10: // <SEQ>
 							
@@ -458,12 +553,15 @@ int read_sam_chunk(struct read_info** ri,struct parameters* param,FILE* file)
                                 MFREE(line);
                                 return c;
                         }
+                }else if(param->contigs && !strncmp(line, "@SQ\t", 4)){
+                        RUN(read_sq_header_line(param, line));
                 }
         }
         MFREE(line);
         return c;
 ERROR:
-        return FAIL;
+        MFREE(line);
+        return -1;
 }
 
 int read_fasta_fastq(struct read_info** ri,struct parameters* param,FILE *file) 
@@ -513,6 +611,9 @@ int read_fasta_fastq(struct read_info** ri,struct parameters* param,FILE *file)
                                 ri[park_pos]->name[i-1] = line[i];
                         }
                         //fprintf(stderr,"LEN:%d	%s\n",len,ri[park_pos]->name);
+                        if(param->tiles){
+                                RUN(read_tile(param->tiles, ri[park_pos]->name, &ri[park_pos]->tile));
+                        }
 			
                         set = 1;
                         size++;
@@ -588,7 +689,7 @@ int read_fasta_fastq(struct read_info** ri,struct parameters* param,FILE *file)
         }
         return size;
 ERROR:
-        return FAIL;
+        return -1;
 }
 
 
@@ -609,6 +710,13 @@ struct read_info** malloc_read_info(struct read_info** ri, int numseq)
                 ri[i]->mapq = -1.0;
                 ri[i]->cigar = 0;
                 ri[i]->md = 0;
+                ri[i]->contig = -1;
+                ri[i]->mcontig = -1;
+                ri[i]->tile = -1;
+                ri[i]->pos = 0;
+                ri[i]->flag = 0;
+                ri[i]->mpos = 0;
+                ri[i]->isize = 0;
 
                 ri[i]->errors = 0;
                 ri[i]->strand = 0;
@@ -654,6 +762,14 @@ struct read_info** clear_read_info(struct read_info** ri, int numseq)
                 ri[i]->len = 0;
                 ri[i]->mapq = 0;
                 ri[i]->cigar = 0;
+                ri[i]->md = 0;
+                ri[i]->contig = -1;
+                ri[i]->mcontig = -1;
+                ri[i]->tile = -1;
+                ri[i]->pos = 0;
+                ri[i]->flag = 0;
+                ri[i]->mpos = 0;
+                ri[i]->isize = 0;
                 ri[i]->errors = 0;
                 ri[i]->strand = 0;
         }
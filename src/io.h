@@ -10,6 +10,13 @@ struct read_info{
 	char* labels;
 	char* cigar;
 	char* md;
+	int contig;
+	int mcontig;
+	int tile;
+	int pos;
+	int flag;
+	int mpos;
+	int isize;
 	int errors;
 	float mapq;
 	int len;
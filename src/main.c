@@ -4,9 +4,65 @@
 #include "io.h"
 #include "hmm.h"
 #include "viz.h"
+#include "ref.h"
+#include "contig.h"
+#include "sketch.h"
 
 #define MAX_SEQ_LEN 512
-#define MAXERROR 100
+#define MAX_CONTIG_SHOWN 50
+
+/* Errors per read: exact below ERROR_EXACT, log buckets (ERROR_SUB per
+   doubling) above. The error rate (errors / aligned length) is counted in
+   0.5% bins; the last bin holds rates of 100% and more. */
+#define ERROR_EXACT_BITS 6
+#define ERROR_EXACT (1 << ERROR_EXACT_BITS)
+#define ERROR_SUB_BITS 2
+#define ERROR_SUB (1 << ERROR_SUB_BITS)
+#define ERROR_BUCKETS (ERROR_EXACT + (31 - ERROR_EXACT_BITS) * ERROR_SUB)
+#define ERROR_RATE_BINS 201
+
+/* Insert sizes below ISIZE_EXACT are counted exactly; above, each doubling
+   is split into ISIZE_SUB log buckets (up to 2^31). */
+#define ISIZE_EXACT 1024
+#define ISIZE_EXACT_BITS 10
+#define ISIZE_SUB_BITS 3
+#define ISIZE_SUB (1 << ISIZE_SUB_BITS)
+#define ISIZE_BUCKETS (ISIZE_EXACT + (31 - ISIZE_EXACT_BITS) * ISIZE_SUB)
+#define ISIZE_PLOT_POINTS 100
+
+/* Duplicates are estimated from the number of distinct keys seen by a
+   HyperLogLog per MAPQ class (2^16 registers: ~0.4% error). */
+#define DUP_HLL_PRECISION 16
+#define DUP_PREFIX_LEN 50
+
+/* Overrepresented sequences: the first OVERREP_LEN bases of every read go
+   into a count-min sketch and a Space-Saving list of OVERREP_TOP_K
+   counters; sequences above OVERREP_MIN_FRACTION of reads are reported. */
+#define OVERREP_LEN 50
+#define OVERREP_TOP_K 1000
+#define OVERREP_MIN_FRACTION 0.001
+#define OVERREP_MAX_SHOWN 50
+
+/* Spliced alignments: intron lengths (CIGAR N) are exact below
+   INTRON_EXACT and log-binned above; junctions (contig, first and last
+   intron base) are counted in a Space-Saving list of JUNCTION_TOP_K
+   entries, so memory stays bounded on any number of junctions. */
+#define INTRON_EXACT_BITS 6
+#define INTRON_SUB_BITS 3
+#define INTRON_BUCKETS ((1 << INTRON_EXACT_BITS) + (31 - INTRON_EXACT_BITS) * (1 << INTRON_SUB_BITS))
+#define JUNCTION_TOP_K 10000
+#define JUNCTION_MAX_SHOWN 50
+
+/* Base qualities are histogrammed per position over the printable range
+   '!' (33) to '~' (126); the phred offset is applied when reporting. */
+#define QUAL_BINS 94
+
+#define ADAPTER_K 12
+#define NUM_ADAPTERS 6
+
+#define PAIR_FR 0
+#define PAIR_RF 1
+#define PAIR_FF 2
 
 #define MAQgt30 0
 #define MAQlt30 1
@@ -18,19 +74,51 @@
 struct seq_stats{
         int** seq_len;
         int*** nuc_composition;
-        long long int** seq_quality;
-        long long int** seq_quality_count;
+        unsigned int** qual_hist;/**< @brief [MAPQ class][pos * QUAL_BINS + qual - 33] */
         int* aln_quality;
         int* alignments;
         int* nuc_num;
-        float** errors;
+        long long int** errors;/**< @brief [MAPQ class][error_bucket(errors)] */
+        long long int** error_rate;/**< @brief [MAPQ class][errors / aligned length in 0.5% bins] */
         double* percent_identity;
         int*** mismatches;
         int*** insertions;
         int** deletions;
         int* base_qualities;
+        long long int* contig_alignments;/**< @brief [contig * 6 + MAPQ class] */
+        long long int* contig_errors;
+        long long int* contig_aln_len;
+        long long int*** insert_size;/**< @brief [orientation][MAPQ class][bucket] */
+        int* insert_size_max;
+        struct hll** dup_hll;
+        long long int* dup_reads;
+        struct cm_sketch* seq_cms;
+        struct top_k* seq_top;
+        struct top_k* junctions;/**< @brief keys: int[3] of contig ID, first and last intron base (0 based) */
+        long long int* spliced_reads;/**< @brief [MAPQ class] reads with at least one N */
+        long long int* intron_len;/**< @brief [log_bucket(intron length)] */
+        long long int** clip_pos;/**< @brief [5' = 0, 3' = 1][read position] soft clipped bases */
+        long long int** clip_len;/**< @brief [5' = 0, 3' = 1][soft clip length] */
+        long long int soft_clipped_reads;
+        long long int soft_clipped_bases;
+        long long int hard_clipped_reads;
+        long long int hard_clipped_bases;
+        long long int** adapter_pos;/**< @brief [adapter][first position in read] */
+        int** gc_content;/**< @brief [MAPQ class][GC percent 0 - 100] */
+        long long int* mapq_hist;
+        long long int* calib_bases;/**< @brief [reported quality * MAX_SEQ_LEN + cycle] aligned bases */
+        long long int* calib_mismatches;/**< @brief as calib_bases, mismatches only */
+        long long int* subst;/**< @brief [cycle * 16 + reference base * 4 + read base] in read orientation */
+        long long int* context;/**< @brief [trinucleotide (5' base * 16 + base * 4 + 3' base) * 4 + read base] */
+        long long int* tile_reads;
+        long long int* tile_qual_sum;
+        long long int* tile_qual_bases;
+        long long int* tile_errors;
+        long long int* tile_aln_len;
 
         int alloc_len; 
+        int alloc_contigs;
+        int alloc_tiles;
         int base_quality_offset;
         int sam;
         int md;
@@ -49,13 +137,33 @@ struct seq_stats{
 };
 
 struct hmm* init_samstat_hmm(int average_length, int max_sequence_len);
+struct hmm** train_samstat_hmms(struct reservoir** samples,struct seq_stats* seq_stats,struct parameters* param);
 struct seq_stats* init_seq_stats(void);
 int clear_seq_stats(struct seq_stats* seq_stats);
 int reformat_base_qualities(struct seq_stats* seq_stats);
 
 void free_seq_stats(struct seq_stats* seq_stats);
+int resize_contig_stats(struct seq_stats* seq_stats,int num_contigs);
+int resize_tile_stats(struct seq_stats* seq_stats,int num_tiles);
+int print_tile_stats(FILE* outfile,struct seq_stats* seq_stats,struct contig_table* tiles);
+int print_contig_stats(FILE* outfile,struct seq_stats* seq_stats,struct contig_table* ct,struct plot_data* pd);
+int print_insert_size_stats(FILE* outfile,struct seq_stats* seq_stats);
+int print_splice_stats(FILE* outfile,struct seq_stats* seq_stats,struct contig_table* ct);
+int print_clip_stats(FILE* outfile,struct seq_stats* seq_stats);
+int print_error_stats(FILE* outfile,struct seq_stats* seq_stats);
+int print_quality_calibration(FILE* outfile,struct seq_stats* seq_stats);
+int print_substitution_stats(FILE* outfile,struct seq_stats* seq_stats);
+int print_duplicate_stats(FILE* outfile,struct seq_stats* seq_stats,struct plot_data* pd);
+uint64_t duplicate_key(struct read_info* ri);
+int print_overrepresented_stats(FILE* outfile,struct seq_stats* seq_stats,struct plot_data* pd);
+int print_gc_stats(FILE* outfile,struct seq_stats* seq_stats);
+int print_mapq_histogram(FILE* outfile,struct seq_stats* seq_stats);
+void init_mapq_classes(int* bounds);
+void print_html_escaped(FILE* outfile,const char* s);
+void set_mapq_series_labels(struct plot_data* pd);
+int print_quality_quantiles(FILE* outfile,struct seq_stats* seq_stats,struct plot_data* pd);
 void print_stats(struct seq_stats* seq_stats);
-int parse_cigar_md(struct read_info* ri,struct seq_stats* seq_stats,int qual_key);
+int parse_cigar_md(struct read_info* ri,struct seq_stats* seq_stats,struct reference* ref,int contig,int qual_key);
 
 char* make_file_stats(char* filename,char* buffer);
 
@@ -63,6 +171,130 @@ char* make_file_stats(char* filename,char* buffer);
 struct hmm_data* hmmdata_init(int size);
 void hmmdata_free(struct hmm_data* hmm_data);
 
+/* Values below 2^exact_bits are their own bucket; above, each doubling is
+   split into 2^sub_bits buckets. */
+static inline int log_bucket(int x,int exact_bits,int sub_bits)
+{
+        int b = exact_bits;
+        if(x < (1 << exact_bits)){
+                return x;
+        }
+        while(x >> (b+1)){
+                b++;
+        }
+        return (1 << exact_bits) + (b - exact_bits) * (1 << sub_bits) + ((x >> (b - sub_bits)) & ((1 << sub_bits)-1));
+}
+
+/* Smallest value falling into bucket (exact buckets map onto themselves). */
+static inline long long int log_bucket_start(int bucket,int exact_bits,int sub_bits)
+{
+        int b;
+        if(bucket < (1 << exact_bits)){
+                return bucket;
+        }
+        b = (bucket - (1 << exact_bits)) / (1 << sub_bits) + exact_bits;
+        return (long long int)((1 << sub_bits) + (bucket - (1 << exact_bits)) % (1 << sub_bits)) << (b - sub_bits);
+}
+
+static inline int insert_size_bucket(int isize)
+{
+        return log_bucket(isize, ISIZE_EXACT_BITS, ISIZE_SUB_BITS);
+}
+
+static inline long long int insert_size_bucket_start(int bucket)
+{
+        return log_bucket_start(bucket, ISIZE_EXACT_BITS, ISIZE_SUB_BITS);
+}
+
+static inline double insert_size_bucket_mid(int bucket)
+{
+        return (double)(insert_size_bucket_start(bucket) + insert_size_bucket_start(bucket+1) - 1) / 2.0;
+}
+
+char* adapter_names[NUM_ADAPTERS] = {"Illumina Universal","Illumina Small RNA 3'","Illumina Small RNA 5'","Nextera Transposase","PolyA","PolyG"};
+char* adapter_seqs[NUM_ADAPTERS] = {"AGATCGGAAGAG","TGGAATTCTCGG","GATCGTCGGACT","CTGTCTCTTATA","AAAAAAAAAAAA","GGGGGGGGGGGG"};
+unsigned int adapter_code[NUM_ADAPTERS];
+
+/* Records the first position of each adapter k-mer in a read (2 bit
+   rolling k-mer, restarted at Ns). */
+static inline void scan_adapters(struct seq_stats* seq_stats,const char* seq,int len)
+{
+        unsigned int kmer = 0;
+        unsigned int mask = (1u << (2 * ADAPTER_K)) - 1;
+        int found = 0;
+        int valid = 0;
+        int j,a;
+
+        if(len > MAX_SEQ_LEN){
+                len = MAX_SEQ_LEN;
+        }
+        for(j = 0; j < len;j++){
+                if(seq[j] < 0 || seq[j] > 3){
+                        valid = 0;
+                        continue;
+                }
+                kmer = ((kmer << 2) | (unsigned int) seq[j]) & mask;
+                if(++valid < ADAPTER_K){
+                        continue;
+                }
+                for(a = 0; a < NUM_ADAPTERS;a++){
+                        if(kmer == adapter_code[a] && !(found & (1 << a))){
+                                found |= 1 << a;
+                                seq_stats->adapter_pos[a][j - ADAPTER_K + 1]++;
+                        }
+                }
+        }
+}
+
+/* Counts G/C and A/C/G/T in an encoded read eight bases at a time. With
+   A0 C1 G2 T3 N4 (5 = '.'), a base is C or G if bit 0 and bit 1 differ and
+   bit 2 is clear, and is one of ACGT if bit 2 is clear. The per byte 0/1
+   flags are summed with a multiply. */
+static inline void count_gc(const char* seq,int len,int* gc,int* acgt)
+{
+        const uint64_t ones = 0x0101010101010101ULL;
+        uint64_t w,flags;
+        int n_gc = 0;
+        int n_acgt = 0;
+        int j = 0;
+
+        for(; j + 8 <= len;j += 8){
+                memcpy(&w, seq + j, 8);
+                flags = ~(w >> 2) & ones;
+                n_acgt += (int)((flags * ones) >> 56);
+                flags &= (w ^ (w >> 1));
+                n_gc += (int)((flags * ones) >> 56);
+        }
+        for(; j < len;j++){
+                if(seq[j] == 1 || seq[j] == 2){
+                        n_gc++;
+                }
+                if(seq[j] >= 0 && seq[j] < 4){
+                        n_acgt++;
+                }
+        }
+        *gc = n_gc;
+        *acgt = n_acgt;
+}
+
+unsigned int qual_bin[256];
+
+/* MAPQ (clamped to 0 - 255) -> class, and the label of each class; built
+   from the -mapq boundaries by init_mapq_classes. */
+int mapq_class[256];
+char mapq_label[6][MAXLABEL_LEN];
+
+static inline int mapq_index(float mapq)
+{
+        if(mapq <= 0.0f){
+                return 0;
+        }
+        if(mapq >= 255.0f){
+                return 255;
+        }
+        return (int) mapq;
+}
+
 unsigned int nuc_code[256];
 
 unsigned int rev_nuc_code[5];
@@ -74,9 +306,10 @@ int main (int argc,char * argv[])
         struct parameters* param = NULL;
         struct seq_stats* seq_stats = NULL;
         struct plot_data* pd = NULL;
-        struct hmm_data* hmm_data= NULL;
         struct hmm** hmms = NULL;
         struct read_info** ri = NULL;
+        struct reference* ref = NULL;
+        struct reservoir* samples[3] = {NULL, NULL, NULL};
         
         int (*fp)(struct read_info** ,struct parameters*,FILE* ) = NULL;
         FILE* file = NULL;
@@ -86,31 +319,25 @@ int main (int argc,char * argv[])
         int qual_key = 0;
         int aln_len = 0;
         int first_lot =1;
-	
-        int mapqual_chunks[1000];
-	
-        for(i =0; i < 1000;i++){
-                if(i == 0){
-                        mapqual_chunks[i] = MAQ0;
-                }else if(i < 3){
-                        mapqual_chunks[i] = MAQlt3 ;
-                }else if(i < 10){
-                        mapqual_chunks[i] = MAQlt10;
-                }else if(i < 20){
-                        mapqual_chunks[i] = MAQlt20;
-                }else if(i < 30){
-                        mapqual_chunks[i] = MAQlt30;
-                }else{
-                        mapqual_chunks[i] = MAQgt30;
-                }
-        }
-	
-	
+        int contig = -1;
+        long long int sum_q,n_q;
+        int gc,acgt;
+        unsigned int* qual_row = NULL;
+        uint64_t hash;
 	
         RUN(init_nuc_code());
+        for(i = 0; i < 256;i++){
+                qual_bin[i] = i < 33 ? 0 : (i - 33 < QUAL_BINS ? i - 33 : QUAL_BINS - 1);
+        }
 	
         RUNP(param = interface(argc,argv));
+        init_mapq_classes(param->mapq_bounds);
 	
+        if(param->reference){
+                sprintf(param->buffer,"Loading reference: %s\n", shorten_pathname(param->reference));
+                param->messages = append_message(param->messages, param->buffer);
+                RUNP(ref = load_reference(param->reference));
+        }
 	
 #ifdef DEBUG
         param->num_query = 1000;
@@ -119,11 +346,18 @@ int main (int argc,char * argv[])
 #endif
 
         RUNP(ri = malloc_read_info(ri, param->num_query ));
+        RUNP(param->contigs = init_contig_table());
+        if(param->tile_stats){
+                RUNP(param->tiles = init_contig_table());
+        }
 	
         RUNP(seq_stats = init_seq_stats());
 	
 	
-        RUNP(hmm_data = hmmdata_init( param->num_query ));
+        /* -samplemem is shared by the three MAPQ groups */
+        for(i = 0; i < 3;i++){
+                RUNP(samples[i] = init_reservoir(param->hmm_sample, (long long int) param->hmm_sample_mem * 1024 * 1024 / 3));
+        }
 	
 	
 	
@@ -131,6 +365,13 @@ int main (int argc,char * argv[])
                 sprintf(param->buffer,"%s\n--------------------------------------------------\n", shorten_pathname(param->infile[fileID]));
                 param->messages = append_message(param->messages, param->buffer);
                 RUN(clear_seq_stats(seq_stats));
+                RUN(clear_contig_table(param->contigs));
+                if(param->tiles){
+                        RUN(clear_contig_table(param->tiles));
+                }
+                for(i = 0; i < 3;i++){
+                        RUN(clear_reservoir(samples[i]));
+                }
                 //outfile
 		
                 RUNP(file = io_handler(file, fileID,param));
@@ -149,6 +390,13 @@ int main (int argc,char * argv[])
                 param->messages = append_message(param->messages, param->buffer);
 		
                 while ((numseq = fp(ri, param,file)) != 0){
+                        ASSERT(numseq > 0, "Could not read file: %s", param->infile[fileID]);
+                        if(param->contigs->num_contigs > seq_stats->alloc_contigs){
+                                RUN(resize_contig_stats(seq_stats, param->contigs->num_contigs));
+                        }
+                        if(param->tiles && param->tiles->num_contigs > seq_stats->alloc_tiles){
+                                RUN(resize_tile_stats(seq_stats, param->tiles->num_contigs));
+                        }
                         for(i = 0; i < numseq;i++){
                                 if(ri[i]->len > seq_stats->max_len){
                                         seq_stats->max_len = ri[i]->len;
@@ -158,14 +406,32 @@ int main (int argc,char * argv[])
                                 }
                                 seq_stats->average_len += ri[i]->len;
 				
-                                qual_key = mapqual_chunks[(int)ri[i]->mapq];
+                                c = mapq_index(ri[i]->mapq);
+                                seq_stats->mapq_hist[c]++;
+                                qual_key = mapq_class[c];
 				
-                                if(ri[i]->cigar && ri[i]->md){
+                                aln_len = 0;
+                                if(ri[i]->cigar){
                                         if(ri[i]->cigar[0] != '*'){
-                                                aln_len = parse_cigar_md(ri[i],seq_stats, qual_key);
-                                                seq_stats->md = 1;
+                                                contig = -1;
+                                                if(ref && !ri[i]->md && ri[i]->contig != -1){
+                                                        contig = param->contigs->ref_id[ri[i]->contig];
+                                                        if(contig == -2){
+                                                                contig = reference_contig(ref, param->contigs->names[ri[i]->contig]);
+                                                                param->contigs->ref_id[ri[i]->contig] = contig;
+                                                        }
+                                                }
+                                                aln_len = parse_cigar_md(ri[i],seq_stats,ref,contig, qual_key);
+                                                if(ri[i]->md || contig != -1){
+                                                        seq_stats->md = 1;
+                                                }
                                         }
                                 }
+                                /* one record per read: no secondary / supplementary alignments */
+                                if(!(ri[i]->flag & 0x900)){
+                                        hll_add(seq_stats->dup_hll[qual_key], duplicate_key(ri[i]));
+                                        seq_stats->dup_reads[qual_key]++;
+                                }
                                 if(ri[i]->strand != 0){
                                         ri[i]->seq = reverse_complement(ri[i]->seq,ri[i]->len);
                                         if(ri[i]->qual[0] != '*'){
@@ -173,20 +439,35 @@ int main (int argc,char * argv[])
 						
                                         }
                                 }
+                                /* HMM training sample - reads in sequencing orientation */
+                                if(ri[i]->mapq >= 20){
+                                        RUN(reservoir_add(samples[0], ri[i]->seq, ri[i]->len));
+                                }else if(ri[i]->mapq > 0){
+                                        RUN(reservoir_add(samples[1], ri[i]->seq, ri[i]->len));
+                                }else if(ri[i]->mapq == 0){
+                                        RUN(reservoir_add(samples[2], ri[i]->seq, ri[i]->len));
+                                }
+                                if(ri[i]->len > 1 || (ri[i]->len == 1 && ri[i]->seq[0] < 4)){
+                                        j = ri[i]->len < OVERREP_LEN ? ri[i]->len : OVERREP_LEN;
+                                        hash = hash_bytes64(ri[i]->seq, j);
+                                        cm_sketch_add(seq_stats->seq_cms, hash);
+                                        top_k_add(seq_stats->seq_top, hash, ri[i]->seq, j);
+                                        scan_adapters(seq_stats, ri[i]->seq, ri[i]->len);
+                                }
                                 if(ri[i]->qual && seq_stats->has_quality){
                                         if(ri[i]->qual[0] != '*'){
-                                                if(ri[i]->len >=  MAX_SEQ_LEN){
-                                                        for(j = 0;j <  MAX_SEQ_LEN;j++){
-                                                                seq_stats->seq_quality[qual_key][j] += (int)(ri[i]->qual[j]) -53;
-                                                                seq_stats->seq_quality_count[qual_key][j] += 1; //(int)(ri[i]->qual[j]);
-                                                                seq_stats->base_qualities[(int)(ri[i]->qual[j])]++;
-                                                        }
-                                                }else{
+                                                c = ri[i]->len < MAX_SEQ_LEN ? ri[i]->len : MAX_SEQ_LEN;
+                                                qual_row = seq_stats->qual_hist[qual_key];
+                                                for(j = 0; j < c;j++){
+                                                        qual_row[qual_bin[(unsigned char) ri[i]->qual[j]]]++;
+                                                        seq_stats->base_qualities[(unsigned char) ri[i]->qual[j]]++;
+                                                        qual_row += QUAL_BINS;
+                                                }
+                                                if(ri[i]->tile != -1){
                                                         for(j = 0; j < ri[i]->len;j++){
-                                                                seq_stats->seq_quality[qual_key][j] += (int)(ri[i]->qual[j]) -53;
-                                                                seq_stats->seq_quality_count[qual_key][j] += 1; //(int)(ri[i]->qual[j]);
-                                                                seq_stats->base_qualities[(int)(ri[i]->qual[j])]++;
+                                                                seq_stats->tile_qual_sum[ri[i]->tile] += qual_bin[(unsigned char) ri[i]->qual[j]];
                                                         }
+                                                        seq_stats->tile_qual_bases[ri[i]->tile] += ri[i]->len;
                                                 }
                                         }else{
                                                 seq_stats->has_quality = 0;
@@ -204,6 +485,10 @@ int main (int argc,char * argv[])
                                 }
                                 // sequence composition
 				
+                                count_gc(ri[i]->seq, ri[i]->len, &gc, &acgt);
+                                if(acgt){
+                                        seq_stats->gc_content[qual_key][(200 * gc + acgt) / (2 * acgt)]++;
+                                }
                                 if(ri[i]->len >=  MAX_SEQ_LEN){
                                         for(j = 0;j <  MAX_SEQ_LEN;j++){
                                                 seq_stats->nuc_num[(int)ri[i]->seq[j]]++;
@@ -216,15 +501,48 @@ int main (int argc,char * argv[])
                                         }
                                 }
 				
+                                /* Count each properly placed pair once, from the
+                                   leftmost primary mate (positive TLEN); TLEN is 0
+                                   for mates on different contigs. Secondary and
+                                   supplementary records repeat the pair's TLEN. */
+                                if((ri[i]->flag & 0xD) == 0x1 && !(ri[i]->flag & 0x900) && ri[i]->isize > 0){
+                                        if((ri[i]->flag & 0x10) == ((ri[i]->flag & 0x20) >> 1)){
+                                                c = PAIR_FF;
+                                        }else if(ri[i]->flag & 0x10){
+                                                c = PAIR_RF;
+                                        }else{
+                                                c = PAIR_FR;
+                                        }
+                                        seq_stats->insert_size[c][qual_key][insert_size_bucket(ri[i]->isize)]++;
+                                        if(ri[i]->isize > seq_stats->insert_size_max[c]){
+                                                seq_stats->insert_size_max[c] = ri[i]->isize;
+                                        }
+                                }
+                                if(ri[i]->tile != -1){
+                                        seq_stats->tile_reads[ri[i]->tile]++;
+                                        if(ri[i]->errors != -1 && aln_len){
+                                                seq_stats->tile_errors[ri[i]->tile] += ri[i]->errors;
+                                                seq_stats->tile_aln_len[ri[i]->tile] += aln_len;
+                                        }
+                                }
+                                if(ri[i]->contig != -1){
+                                        seq_stats->contig_alignments[ri[i]->contig * 6 + qual_key]++;
+                                        if(ri[i]->errors != -1 && aln_len){
+                                                seq_stats->contig_errors[ri[i]->contig] += ri[i]->errors;
+                                                seq_stats->contig_aln_len[ri[i]->contig] += aln_len;
+                                        }
+                                }
                                 if(ri[i]->errors != -1){
                                         if(ri[i]->errors > seq_stats->max_error_per_read){
                                                 seq_stats->max_error_per_read = ri[i]->errors;
                                         }
-                                        seq_stats->percent_identity[qual_key] +=(((double)aln_len - (double)ri[i]->errors) / (double)aln_len * 100.0);
-                                        if(ri[i]->errors >= MAXERROR){
-                                                seq_stats->errors[qual_key][MAXERROR-1]++;
-                                        }else{
-                                                seq_stats->errors[qual_key][ri[i]->errors]++;
+                                        if(aln_len){
+                                                seq_stats->percent_identity[qual_key] +=(((double)aln_len - (double)ri[i]->errors) / (double)aln_len * 100.0);
+                                        }
+                                        seq_stats->errors[qual_key][log_bucket(ri[i]->errors, ERROR_EXACT_BITS, ERROR_SUB_BITS)]++;
+                                        if(aln_len){
+                                                c = (int)(200LL * ri[i]->errors / aln_len);
+                                                seq_stats->error_rate[qual_key][c < ERROR_RATE_BINS ? c : ERROR_RATE_BINS-1]++;
                                         }
                                 }
                         }
@@ -235,98 +553,17 @@ int main (int argc,char * argv[])
                         if(seq_stats->min_len > MAX_SEQ_LEN-1){
                                 seq_stats->min_len  = MAX_SEQ_LEN -1;
                         }
-                        //needs to be run after sequences are reverse complemented.....
                         if(first_lot){
                                 first_lot = 0;
                                 seq_stats->average_len = (int) floor((double) seq_stats->average_len / (double) numseq   + 0.5);
                                 RUN(reformat_base_qualities(seq_stats));
-				
-                                seq_stats->hmm_length =seq_stats->min_len;
-                                if((seq_stats->min_len & 1) == 0){
-                                        seq_stats->hmm_length =seq_stats->min_len -1;
-                                }
-				
-                                if(seq_stats->hmm_length > 41){
-                                        seq_stats->hmm_length = 41;
-                                }
-				
-				
-				
-                                hmms = NULL;
-                                MMALLOC(hmms,sizeof(struct hmm*) * 3) ;
-				
-                                for(i =0 ; i < 3;i++){
-                                        hmms[i] = NULL;
-                                        RUNP(hmms[i] = init_samstat_hmm(seq_stats->hmm_length, seq_stats->max_len));
-                                }
-				
-                                // run for Q20-40  and unmapped.
-                                j = 0;
-                                for(i = 0; i < numseq;i++){
-                                        if(ri[i]->mapq >= 20){
-                                                hmm_data->length[j] = ri[i]->len;
-                                                hmm_data->string[j] = ri[i]->seq;
-                                                hmm_data->weight[j] = prob2scaledprob(1.0);
-                                                j++;
-                                        }
-                                }
-                                hmm_data->num_seq =j;
-                                if(j > 100){
-                                        sprintf(param->buffer,"Training a HMM on mapq > 20 reads.\n");
-                                        param->messages = append_message(param->messages, param->buffer);
-                                        RUN(run_EM_iterations(hmms[0],hmm_data));
-                                        sprintf(param->buffer,"Done.\n");
-                                        param->messages = append_message(param->messages, param->buffer);
-                                        //print_hmm_parameters(hmms[0]);
-                                        //exit(0);
-                                }else{
-                                        free_hmm(hmms[0]);
-                                        hmms[0] = 0;
-                                }
-                                j = 0;
-                                for(i = 0; i < numseq;i++){
-                                        if(ri[i]->mapq > 0 && ri[i]->mapq < 20){
-                                                hmm_data->length[j] = ri[i]->len;
-                                                hmm_data->string[j] = ri[i]->seq;
-                                                hmm_data->weight[j] = prob2scaledprob(1.0);
-                                                j++;
-                                        }
-                                }
-                                hmm_data->num_seq =j;
-                                if(j > 100){
-                                        sprintf(param->buffer,"Training a HMM on 0  <= mapq  < 20 reads.\n");
-                                        param->messages = append_message(param->messages, param->buffer);
-                                        RUN(run_EM_iterations(hmms[1],hmm_data));
-                                        sprintf(param->buffer,"Done.\n");
-                                        param->messages = append_message(param->messages, param->buffer);
-                                }else{
-                                        free_hmm(hmms[1]);
-                                        hmms[1] = 0;
-                                }
-				
-                                j = 0;
-                                for(i = 0; i < numseq;i++){
-                                        if(ri[i]->mapq ==  0){
-                                                hmm_data->length[j] = ri[i]->len;
-                                                hmm_data->string[j] = ri[i]->seq;
-                                                hmm_data->weight[j] = prob2scaledprob(1.0);
-                                                j++;
-                                        }
-                                }
-                                hmm_data->num_seq =j;
-                                if(j > 100){
-                                        sprintf(param->buffer,"Training a HMM on unmapped reads.\n");
-                                        param->messages = append_message(param->messages, param->buffer);
-                                        RUN(run_EM_iterations(hmms[2],hmm_data));
-                                        sprintf(param->buffer,"Done.\n");
-                                        param->messages = append_message(param->messages, param->buffer);
-                                }else{
-                                        free_hmm(hmms[2]);
-                                        hmms[2] = 0;
-                                }
                         }
                 }
                 pclose(file);
+
+                if(seq_stats->total_reads){
+                        RUNP(hmms = train_samstat_hmms(samples, seq_stats, param));
+                }
                
 #ifdef DEBUG
                 print_stats(seq_stats);
@@ -372,31 +609,26 @@ int main (int argc,char * argv[])
 		
                         sprintf(pd->labels[0], "%s","Number");
                         sprintf(pd->labels[1], "%s","Percentage");
+                        set_mapq_series_labels(pd);
 		
                         pd->data[5][0] =  seq_stats->alignments[MAQ0];
                         pd->data[5][1] =  (float)seq_stats->alignments[MAQ0] / (float)seq_stats->total_reads * 100.0;
-                        sprintf(pd->series_labels[5], "Unmapped");
 		
                         pd->data[4][0] =  seq_stats->alignments[MAQlt3];
                         pd->data[4][1] =  (float)seq_stats->alignments[MAQlt3] / (float)seq_stats->total_reads* 100.0;
-                        sprintf(pd->series_labels[4], "MAPQ  <  3");
 		
                         pd->data[3][0] =  seq_stats->alignments[MAQlt10];
                         pd->data[3][1] =  (float)seq_stats->alignments[MAQlt10] / (float)seq_stats->total_reads* 100.0;
-                        sprintf(pd->series_labels[3], "MAPQ  < 10");
 		
                         pd->data[2][0] =  seq_stats->alignments[MAQlt20];
                         pd->data[2][1] =  (float)seq_stats->alignments[MAQlt20] / (float)seq_stats->total_reads* 100.0;
-                        sprintf(pd->series_labels[2], "MAPQ  < 20");
 		
                         pd->data[1][0] =  seq_stats->alignments[MAQlt30];
                         pd->data[1][1] =  (float)seq_stats->alignments[MAQlt30] / (float)seq_stats->total_reads* 100.0;
-                        sprintf(pd->series_labels[1], "MAPQ  < 30");
 		
                         pd->data[0][0] =  seq_stats->alignments[MAQgt30];
                         pd->data[0][1] =  (float)seq_stats->alignments[MAQgt30] / (float)seq_stats->total_reads* 100.0;
 		
-                        sprintf(pd->series_labels[0], "MAPQ >= 30");
 		
                         pd->num_points = 1;
                         pd->num_series = 6;
@@ -418,9 +650,15 @@ int main (int argc,char * argv[])
                         sprintf(pd->description,"Number of alignments in various mapping quality (MAPQ) intervals and number of unmapped sequences.");
 		
                         print_html_table(outfile, pd);
+                        RUN(print_mapq_histogram(outfile, seq_stats));
 		
-		
-		
+                        RUN(print_contig_stats(outfile, seq_stats, param->contigs, pd));
+                        RUN(print_insert_size_stats(outfile, seq_stats));
+                        RUN(print_splice_stats(outfile, seq_stats, param->contigs));
+                        RUN(print_clip_stats(outfile, seq_stats));
+                        RUN(print_duplicate_stats(outfile, seq_stats, pd));
+                        RUN(print_overrepresented_stats(outfile, seq_stats, pd));
+                        RUN(print_gc_stats(outfile, seq_stats));
 		
                         pd->color_scheme = 0;
                         pd->width = 900;
@@ -436,12 +674,7 @@ int main (int argc,char * argv[])
 			
                         }else{
                                 plots =0;
-                                sprintf(pd->series_labels[5], "Unmapped");
-                                sprintf(pd->series_labels[4], "MAPQ  <  3");
-                                sprintf(pd->series_labels[3], "MAPQ  < 10");
-                                sprintf(pd->series_labels[2], "MAPQ  < 20");
-                                sprintf(pd->series_labels[1], "MAPQ  < 30");
-                                sprintf(pd->series_labels[0], "MAPQ >= 30");
+                                set_mapq_series_labels(pd);
                                 for(i = 0; i < 6;i++){
                                         if(plots ==0){
                                                 sprintf(pd->labels[0], "%dnt",seq_stats->min_len-1);
@@ -484,12 +717,7 @@ int main (int argc,char * argv[])
                                 fprintf(outfile,"<h2>Base Quality Distribution: All bases have quality \"%c\"</h2>\n",(char) seq_stats->max_base_quality);
                         }else{
 			
-                                sprintf(pd->series_labels[5], "Unmapped");
-                                sprintf(pd->series_labels[4], "MAPQ  <  3");
-                                sprintf(pd->series_labels[3], "MAPQ  < 10");
-                                sprintf(pd->series_labels[2], "MAPQ  < 20");
-                                sprintf(pd->series_labels[1], "MAPQ  < 30");
-                                sprintf(pd->series_labels[0], "MAPQ >= 30");
+                                set_mapq_series_labels(pd);
                                 if (seq_stats->base_quality_offset != -1){
 				
                                         for(i = 0; i < 6;i++){
@@ -497,10 +725,17 @@ int main (int argc,char * argv[])
                                                         if(plots ==0){
                                                                 sprintf(pd->labels[j], "%dnt",j+1);
                                                         }
+                                                        pd->data[i][j] = 0;
                                                         if(seq_stats->alignments[i] ){
-                                                                pd->data[i][j] =  ((float)seq_stats->seq_quality[i][j] /   (float)seq_stats->seq_quality_count[i][j]) + 53   - (float)seq_stats->base_quality_offset;
-                                                        }else{
-                                                                pd->data[i][j] = 0;
+                                                                sum_q = 0;
+                                                                n_q = 0;
+                                                                for(c = 0; c < QUAL_BINS;c++){
+                                                                        sum_q += (long long int) c * seq_stats->qual_hist[i][j * QUAL_BINS + c];
+                                                                        n_q += seq_stats->qual_hist[i][j * QUAL_BINS + c];
+                                                                }
+                                                                if(n_q){
+                                                                        pd->data[i][j] = (float) sum_q / (float) n_q + 33 - (float)seq_stats->base_quality_offset;
+                                                                }
                                                         }
                                                 }
                                         }
@@ -520,6 +755,9 @@ int main (int argc,char * argv[])
                                         pd->plot_type = LINE_PLOT;
                                         print_html5_chart(outfile, pd);
 				
+                                        RUN(print_quality_quantiles(outfile, seq_stats, pd));
+                                        RUN(print_quality_calibration(outfile, seq_stats));
+				
                                         //pd->num_points = 0;
                                         //pd->num_series = 6;
                                         //sprintf(pd->description,"Base quality distributions separated by mapping quality thresholds.");
@@ -528,6 +766,10 @@ int main (int argc,char * argv[])
                                 }
                         }
 		
+                        if(param->tiles){
+                                RUN(print_tile_stats(outfile, seq_stats, param->tiles));
+                        }
+		
                         ///HMM plots - need to count  nucleotide frequencies.. .
 		
                         float sum = 0;
@@ -549,6 +791,7 @@ int main (int argc,char * argv[])
 			
                                 sprintf(pd->plot_title, "Composition of MAPQ >= 20 Reads.");
                                 sprintf(pd->description,"A HMM was trained on a subset of the sequences. Shown are log2 odds ratios comparing emission probabilities in match states to background nucleotide probabilities. Values above 0 indicate positional enrichment of a particular nucleotide. \"L\" indicates the emission probabilities for a state modelling residiues in the middle of the reads. ");
+                                sprintf(pd->description + strlen(pd->description)," EM ran for %d iterations (log likelihood of the training reads: %0.1f).", hmms[0]->em_iterations, hmms[0]->log_likelihood);
                                 //fprintf(stderr,"Got here\n");
                                 for(j = 2; j < seq_stats->hmm_length +2;j++){
 				
@@ -595,6 +838,7 @@ int main (int argc,char * argv[])
 			
                                 sprintf(pd->plot_title, "Composition of  0 >= MAPQ <  20 Reads. ");
                                 sprintf(pd->description,"A HMM was trained on a subset of the sequences. Shown are log2 odds ratios comparing emission probabilities in match states to background nucleotide probabilities. Values above 0 indicate positional enrichment of a particular nucleotide. \"L\" indicates the emission probabilities for a state modelling residiues in the middle of the reads. ");
+                                sprintf(pd->description + strlen(pd->description)," EM ran for %d iterations (log likelihood of the training reads: %0.1f).", hmms[1]->em_iterations, hmms[1]->log_likelihood);
                                 //fprintf(stderr,"Got here\n");
                                 for(j = 2; j < seq_stats->hmm_length +2;j++){
 				
@@ -628,6 +872,7 @@ int main (int argc,char * argv[])
 			
                                 sprintf(pd->plot_title, "Composition of unmapped reads.");
                                 sprintf(pd->description,"A HMM was trained on a subset of the sequences. Shown are log2 odds ratios comparing emission probabilities in match states to background nucleotide probabilities. Values above 0 indicate positional enrichment of a particular nucleotide. \"L\" indicates the emission probabilities for a state modelling residiues in the middle of the reads.");
+                                sprintf(pd->description + strlen(pd->description)," EM ran for %d iterations (log likelihood of the training reads: %0.1f).", hmms[2]->em_iterations, hmms[2]->log_likelihood);
                                 //fprintf(stderr,"Got here\n");
                                 for(j = 2; j < seq_stats->hmm_length +2;j++){
 				
@@ -677,34 +922,8 @@ int main (int argc,char * argv[])
                         }
 		
                         for(i = 0; i < 5;i++){
-                                switch (i) {
-                                case 0:
-                                        sprintf(pd->plot_title, "Distribution of Mismatches (MAPQ >= 30):");
-                                        sprintf(pd->description,"Distribution of Mismatches in MAPQ >= 30 reads.");
-                                        break;
-                                case 1:
-                                        sprintf(pd->plot_title, "Distribution of Mismatches (MAPQ < 30):");
-                                        sprintf(pd->description,"Distribution of Mismatches in MAPQ < 30 reads.");
-                                        break;
-					
-                                case 2:
-                                        sprintf(pd->plot_title, "Distribution of Mismatches (MAPQ < 20):");
-                                        sprintf(pd->description,"Distribution of Mismatches in MAPQ < 20 reads.");
-                                        break;
-					
-                                case 3:
-                                        sprintf(pd->plot_title, "Distribution of Mismatches (MAPQ < 10):");
-                                        sprintf(pd->description,"Distribution of Mismatches in MAPQ < 10 reads.");
-                                        break;
-					
-                                case 4:
-                                        sprintf(pd->plot_title, "Distribution of Mismatches(MAPQ < 3):");
-                                        sprintf(pd->description,"Distribution of Mismatches in MAPQ < 3 reads.");
-                                        break;
-					
-                                default:
-                                        break;
-                                }
+                                sprintf(pd->plot_title, "Distribution of Mismatches (%s):", mapq_label[i]);
+                                sprintf(pd->description,"Distribution of Mismatches in %s reads.", mapq_label[i]);
                                 if(seq_stats->alignments[i]){
                                         for(j = 0; j <= seq_stats->max_len;j++){
                                                 sprintf(pd->labels[j], "%dnt",j+1);
@@ -722,53 +941,8 @@ int main (int argc,char * argv[])
                         pd->width = 900;
                         pd->color_scheme = 0;
 		
-                        //fprintf(stderr,"Errors :\n");
-                        for(i = 0; i < 5;i++){
-                                switch (i) {
-                                case 0:
-                                        sprintf(pd->plot_title, "Number of Errors Per Read (MAPQ >= 30):");
-                                        sprintf(pd->description,"Barplot shows the percentage of reads (y-axis) with 0, 1, 2 ... errors (x axis) for MAPQ >= 30 reads.");
-                                        break;
-                                case 1:
-                                        sprintf(pd->plot_title, "Number of Errors Per Read(MAPQ < 30):");
-                                        sprintf(pd->description,"Barplot shows the percentage of reads (y-axis) with 0, 1, 2 ... errors (x axis) for MAPQ < 30 reads.");
-                                        break;
-					
-                                case 2:
-                                        sprintf(pd->plot_title, "Number of Errors Per Read(MAPQ < 20):");
-                                        sprintf(pd->description,"Barplot shows the percentage of reads (y-axis) with 0, 1, 2 ... errors (x axis) for MAPQ < 20 reads.");
-                                        break;
-					
-                                case 3:
-                                        sprintf(pd->plot_title, "Number of Errors Per Read(MAPQ < 10):");
-                                        sprintf(pd->description,"Barplot shows the percentage of reads (y-axis) with 0, 1, 2 ... errors (x axis) for MAPQ < 10 reads.");
-                                        break;
-					
-                                case 4:
-                                        sprintf(pd->plot_title, "Number of Errors Per Read(MAPQ < 3):");
-                                        sprintf(pd->description,"Barplot shows the percentage of reads (y-axis) with 0, 1, 2 ... errors (x axis) for MAPQ < 3 reads.");
-                                        break;
-					
-                                default:
-                                        break;
-                                }
-                                if(seq_stats->alignments[i]){
-                                        for(j = 0; j <= seq_stats->max_error_per_read;j++){
-                                                sprintf(pd->labels[j], "%d",j);
-                                                pd->data[0][j] = 100.0 * (float)seq_stats->errors[i][j]/ (float)seq_stats->alignments[i];
-                                        }
-				
-                                        sprintf(pd->series_labels[0],"Errors");
-                                        pd->num_points = seq_stats->max_error_per_read ;
-                                        pd->num_series = 1;
-                                        pd->width = 300;
-                                        pd->num_points_shown = 10;//seq_stats->max_error_per_read;
-				
-				
-                                        pd->plot_type = BAR_PLOT;
-                                        print_html5_chart(outfile, pd);
-                                }
-                        }
+                        RUN(print_error_stats(outfile, seq_stats));
+                        RUN(print_substitution_stats(outfile, seq_stats));
 		
                         for(i =0 ; i < 3;i++){
                                 if(hmms[i]){
@@ -788,13 +962,19 @@ int main (int argc,char * argv[])
         }
 	
 
-        hmmdata_free(hmm_data);
-        ///hmmdata_free
+        for(i = 0; i < 3;i++){
+                free_reservoir(samples[i]);
+        }
 	
 	
         free_seq_stats(seq_stats);
 	
         free_read_info(ri, param->num_query);
+        free_contig_table(param->contigs);
+        param->contigs = NULL;
+        free_contig_table(param->tiles);
+        param->tiles = NULL;
+        free_reference(ref);
         free_param(param);
 	
 	
@@ -815,9 +995,18 @@ struct hmm_data* hmmdata_init(int size)
         hmm_data->score = 0;
         hmm_data->string = 0;
         hmm_data->iterations = 5;
+        hmm_data->tolerance = 1e-4f;
         hmm_data->run_mode = MODE_BAUM_WELCH;
         hmm_data->num_threads = 4;
         hmm_data->weight = 0;
+        hmm_data->pool = NULL;
+        hmm_data->workers = NULL;
+        hmm_data->num_workers = 0;
+        hmm_data->batches = NULL;
+        hmm_data->num_batches = 0;
+        hmm_data->alloc_batches = 0;
+        hmm_data->batch_est = NULL;
+        hmm_data->alloc_est = 0;
 	
         MMALLOC(hmm_data->length,sizeof(int) *size);
         MMALLOC(hmm_data->weight,sizeof(float) *size);
@@ -839,6 +1028,7 @@ ERROR:
 void hmmdata_free(struct hmm_data* hmm_data)
 {
         if(hmm_data){
+                free_hmm_workers(hmm_data);
                 if(hmm_data->length){
                         MFREE(hmm_data->length);//,sizeof(int) *size);
                 }
@@ -967,6 +1157,97 @@ ERROR:
 
 
 
+/* Trains one HMM per MAPQ group (>= 20, 1-19, 0) on the reservoir samples
+   of the whole file; groups with 100 reads or fewer get NULL. The samples
+   of all groups are copied into one hmm_data. run_EM_models then trains
+   the three models together on this shared pool of reads. */
+struct hmm** train_samstat_hmms(struct reservoir** samples,struct seq_stats* seq_stats,struct parameters* param)
+{
+        static const char* group_name[3] = {"mapq >= 20", "1 <= mapq < 20", "mapq 0"};
+        struct hmm_data* hmm_data = NULL;
+        struct hmm** hmms = NULL;
+        struct reservoir* rs = NULL;
+        int start[4];
+        int max_len;
+        int i,j,n;
+
+        seq_stats->hmm_length =seq_stats->min_len;
+        if((seq_stats->min_len & 1) == 0){
+                seq_stats->hmm_length =seq_stats->min_len -1;
+        }
+        if(seq_stats->hmm_length > 41){
+                seq_stats->hmm_length = 41;
+        }
+
+        n = 0;
+        for(i = 0; i < 3;i++){
+                if(samples[i]->n > 100){
+                        n += samples[i]->n;
+                }else if(samples[i]->seen > 100 && samples[i]->size < samples[i]->k){
+                        sprintf(param->buffer,"No HMM for %s reads: only %d fit into -samplemem.\n", group_name[i], samples[i]->n);
+                        param->messages = append_message(param->messages, param->buffer);
+                }
+        }
+        MMALLOC(hmms,sizeof(struct hmm*) * 3);
+        for(i = 0; i < 3;i++){
+                hmms[i] = NULL;
+        }
+        if(!n){
+                return hmms;
+        }
+        RUNP(hmm_data = hmmdata_init(n));
+        n = 0;
+        for(i = 0; i < 3;i++){
+                rs = samples[i];
+                start[i] = n;
+                if(rs->n <= 100){
+                        continue;
+                }
+                /* max_len is capped at MAX_SEQ_LEN for the plots but the
+                   HMMs see whole reads; the chain kernels keep only
+                   O(sqrt(len)) rows, so size them by the longest read. */
+                max_len = 0;
+                for(j = 0; j < rs->n;j++){
+                        hmm_data->length[n] = rs->len[j];
+                        hmm_data->string[n] = rs->seq[j];
+                        hmm_data->weight[n] = prob2scaledprob(1.0);
+                        if(rs->len[j] > max_len){
+                                max_len = rs->len[j];
+                        }
+                        n++;
+                }
+                /* reservoir order is random; sorted, the chain kernels
+                   can batch reads of equal length */
+                RUN(sort_hmm_data_by_length(hmm_data, start[i], n));
+
+                RUNP(hmms[i] = init_samstat_hmm(seq_stats->hmm_length, max_len));
+                if(rs->seen > rs->n){
+                        sprintf(param->buffer,"Training a HMM on %s reads (%d sampled of %lld).\n", group_name[i], rs->n, rs->seen);
+                }else{
+                        sprintf(param->buffer,"Training a HMM on %s reads.\n", group_name[i]);
+                }
+                param->messages = append_message(param->messages, param->buffer);
+        }
+        start[3] = n;
+        hmm_data->num_seq = n;
+        RUN(run_EM_models(hmms, 3, start, hmm_data));
+        sprintf(param->buffer,"Done.\n");
+        param->messages = append_message(param->messages, param->buffer);
+        hmmdata_free(hmm_data);
+        return hmms;
+ERROR:
+        hmmdata_free(hmm_data);
+        if(hmms){
+                for(i = 0; i < 3;i++){
+                        if(hmms[i]){
+                                free_hmm(hmms[i]);
+                        }
+                }
+                MFREE(hmms);
+        }
+        return NULL;
+}
+
 struct hmm* init_samstat_hmm(int average_length, int max_sequence_len)
 {
         struct hmm* hmm = NULL;
@@ -1041,6 +1322,7 @@ struct hmm* init_samstat_hmm(int average_length, int max_sequence_len)
                 }
                 hmm->tindex[i][0] = c+1;
         }	
+        RUN(set_chain_model(hmm, average_length/2 + 2));
         return hmm;
 ERROR:
         free_hmm(hmm);
@@ -1059,16 +1341,48 @@ struct seq_stats* init_seq_stats(void)
         seq_stats->aln_quality = NULL;
         seq_stats->deletions = NULL;
         seq_stats->errors = NULL;
+        seq_stats->error_rate = NULL;
         seq_stats->insertions =NULL;
         seq_stats->mismatches = NULL;
         seq_stats->nuc_composition = NULL;
         seq_stats->nuc_num = NULL;
         seq_stats->percent_identity = NULL;
         seq_stats->seq_len = NULL;
-        seq_stats->seq_quality = NULL;
-        seq_stats->seq_quality_count = NULL;
+        seq_stats->qual_hist = NULL;
 	
         seq_stats->base_qualities = NULL;
+        seq_stats->contig_alignments = NULL;
+        seq_stats->contig_errors = NULL;
+        seq_stats->contig_aln_len = NULL;
+        seq_stats->alloc_contigs = 0;
+        seq_stats->tile_reads = NULL;
+        seq_stats->tile_qual_sum = NULL;
+        seq_stats->tile_qual_bases = NULL;
+        seq_stats->tile_errors = NULL;
+        seq_stats->tile_aln_len = NULL;
+        seq_stats->alloc_tiles = 0;
+        seq_stats->insert_size = NULL;
+        seq_stats->insert_size_max = NULL;
+        seq_stats->dup_hll = NULL;
+        seq_stats->dup_reads = NULL;
+        seq_stats->seq_cms = NULL;
+        seq_stats->seq_top = NULL;
+        seq_stats->junctions = NULL;
+        seq_stats->spliced_reads = NULL;
+        seq_stats->intron_len = NULL;
+        seq_stats->clip_pos = NULL;
+        seq_stats->clip_len = NULL;
+        seq_stats->soft_clipped_reads = 0;
+        seq_stats->soft_clipped_bases = 0;
+        seq_stats->hard_clipped_reads = 0;
+        seq_stats->hard_clipped_bases = 0;
+        seq_stats->adapter_pos = NULL;
+        seq_stats->gc_content = NULL;
+        seq_stats->mapq_hist = NULL;
+        seq_stats->calib_bases = NULL;
+        seq_stats->calib_mismatches = NULL;
+        seq_stats->subst = NULL;
+        seq_stats->context = NULL;
         seq_stats->total_reads = 0;
         seq_stats->has_quality = 1;
         seq_stats->hmm_length = 0;
@@ -1078,12 +1392,12 @@ struct seq_stats* init_seq_stats(void)
 	
         MMALLOC(seq_stats->seq_len,sizeof(int*)* 6);
         MMALLOC(seq_stats->nuc_composition,sizeof(int**)* 6);
-        MMALLOC(seq_stats->seq_quality,sizeof(long long int*)* 6);
-        MMALLOC(seq_stats->seq_quality_count,sizeof(long long int*)* 6);
+        MMALLOC(seq_stats->qual_hist,sizeof(unsigned int*)* 6);
         MMALLOC(seq_stats->aln_quality,sizeof(int)*6);
         MMALLOC(seq_stats->nuc_num,sizeof(int) * 6);
         //seq_stats->overall_kmers= malloc(sizeof(float) * KMERALLOC);
-        MMALLOC(seq_stats->errors,sizeof(float*)* 6 );
+        MMALLOC(seq_stats->errors,sizeof(long long int*)* 6 );
+        MMALLOC(seq_stats->error_rate,sizeof(long long int*)* 6 );
 	
         MMALLOC(seq_stats->percent_identity,sizeof(double)* 6 );
 	
@@ -1095,11 +1409,108 @@ struct seq_stats* init_seq_stats(void)
                 seq_stats->base_qualities[i] = 0;
         }
 	
+        MMALLOC(seq_stats->dup_hll, sizeof(struct hll*) * 6);
+        MMALLOC(seq_stats->dup_reads, sizeof(long long int) * 6);
+        for(c = 0; c < 6;c++){
+                seq_stats->dup_hll[c] = NULL;
+                seq_stats->dup_reads[c] = 0;
+        }
+        for(c = 0; c < 6;c++){
+                RUNP(seq_stats->dup_hll[c] = init_hll(DUP_HLL_PRECISION));
+        }
+	
+        RUNP(seq_stats->seq_cms = init_cm_sketch(16, 4));
+        RUNP(seq_stats->seq_top = init_top_k(OVERREP_TOP_K, OVERREP_LEN));
+        RUNP(seq_stats->junctions = init_top_k(JUNCTION_TOP_K, 3 * sizeof(int)));
+        MMALLOC(seq_stats->spliced_reads, sizeof(long long int) * 6);
+        MMALLOC(seq_stats->intron_len, sizeof(long long int) * INTRON_BUCKETS);
+        MMALLOC(seq_stats->clip_pos, sizeof(long long int*) * 2);
+        MMALLOC(seq_stats->clip_len, sizeof(long long int*) * 2);
+        for(i = 0; i < 2;i++){
+                seq_stats->clip_pos[i] = NULL;
+                seq_stats->clip_len[i] = NULL;
+                MMALLOC(seq_stats->clip_pos[i], sizeof(long long int) * MAX_SEQ_LEN);
+                MMALLOC(seq_stats->clip_len[i], sizeof(long long int) * MAX_SEQ_LEN);
+        }
+        for(i = 0; i < 6;i++){
+                seq_stats->spliced_reads[i] = 0;
+        }
+        for(i = 0; i < INTRON_BUCKETS;i++){
+                seq_stats->intron_len[i] = 0;
+        }
+        for(i = 0; i < 2;i++){
+                for(j = 0; j < MAX_SEQ_LEN;j++){
+                        seq_stats->clip_pos[i][j] = 0;
+                        seq_stats->clip_len[i][j] = 0;
+                }
+        }
+        seq_stats->soft_clipped_reads = 0;
+        seq_stats->soft_clipped_bases = 0;
+        seq_stats->hard_clipped_reads = 0;
+        seq_stats->hard_clipped_bases = 0;
+        MMALLOC(seq_stats->adapter_pos, sizeof(long long int*) * NUM_ADAPTERS);
+        for(i = 0; i < NUM_ADAPTERS;i++){
+                seq_stats->adapter_pos[i] = NULL;
+        }
+        for(i = 0; i < NUM_ADAPTERS;i++){
+                MMALLOC(seq_stats->adapter_pos[i], sizeof(long long int) * MAX_SEQ_LEN);
+                for(j = 0; j < MAX_SEQ_LEN;j++){
+                        seq_stats->adapter_pos[i][j] = 0;
+                }
+                adapter_code[i] = 0;
+                for(j = 0; j < ADAPTER_K;j++){
+                        adapter_code[i] = (adapter_code[i] << 2) | nuc_code[(int) adapter_seqs[i][j]];
+                }
+        }
+	
+        MMALLOC(seq_stats->mapq_hist, sizeof(long long int) * 256);
+        for(i = 0; i < 256;i++){
+                seq_stats->mapq_hist[i] = 0;
+        }
+        MMALLOC(seq_stats->calib_bases, sizeof(long long int) * QUAL_BINS * MAX_SEQ_LEN);
+        MMALLOC(seq_stats->calib_mismatches, sizeof(long long int) * QUAL_BINS * MAX_SEQ_LEN);
+        MMALLOC(seq_stats->subst, sizeof(long long int) * MAX_SEQ_LEN * 16);
+        MMALLOC(seq_stats->context, sizeof(long long int) * 64 * 4);
+        memset(seq_stats->calib_bases, 0, sizeof(long long int) * QUAL_BINS * MAX_SEQ_LEN);
+        memset(seq_stats->calib_mismatches, 0, sizeof(long long int) * QUAL_BINS * MAX_SEQ_LEN);
+        memset(seq_stats->subst, 0, sizeof(long long int) * MAX_SEQ_LEN * 16);
+        memset(seq_stats->context, 0, sizeof(long long int) * 64 * 4);
+        MMALLOC(seq_stats->gc_content, sizeof(int*) * 6);
+        for(c = 0; c < 6;c++){
+                seq_stats->gc_content[c] = NULL;
+        }
+        for(c = 0; c < 6;c++){
+                MMALLOC(seq_stats->gc_content[c], sizeof(int) * 101);
+                for(i = 0; i <= 100;i++){
+                        seq_stats->gc_content[c][i] = 0;
+                }
+        }
+	
+        MMALLOC(seq_stats->insert_size, sizeof(long long int**) * 3);
+        MMALLOC(seq_stats->insert_size_max, sizeof(int) * 3);
+        for(i = 0; i < 3;i++){
+                seq_stats->insert_size[i] = NULL;
+                seq_stats->insert_size_max[i] = 0;
+        }
+        for(i = 0; i < 3;i++){
+                MMALLOC(seq_stats->insert_size[i], sizeof(long long int*) * 6);
+                for(c = 0; c < 6;c++){
+                        seq_stats->insert_size[i][c] = NULL;
+                }
+                for(c = 0; c < 6;c++){
+                        MMALLOC(seq_stats->insert_size[i][c], sizeof(long long int) * ISIZE_BUCKETS);
+                        for(j = 0; j < ISIZE_BUCKETS;j++){
+                                seq_stats->insert_size[i][c][j] = 0;
+                        }
+                }
+        }
+	
         for(c = 0; c < 6;c++){
                 seq_stats->mismatches[c] = NULL;
                 seq_stats->insertions[c] = NULL;
                 seq_stats->deletions[c] = NULL;
                 seq_stats->errors[c] = NULL;
+                seq_stats->error_rate[c] = NULL;
 		
                 seq_stats->nuc_num[c] = 0;
                 seq_stats->alignments[c] = 0;
@@ -1107,25 +1518,27 @@ struct seq_stats* init_seq_stats(void)
 		
                 seq_stats->seq_len[c] = NULL;
                 seq_stats->nuc_composition[c] = NULL;
-                seq_stats->seq_quality[c] = NULL;
-                seq_stats->seq_quality_count[c] = NULL;
+                seq_stats->qual_hist[c] = NULL;
 	
                 MMALLOC(seq_stats->mismatches[c],sizeof(int*)* seq_stats->alloc_len);
                 MMALLOC(seq_stats->insertions[c],sizeof(int*) * seq_stats->alloc_len);
                 MMALLOC(seq_stats->deletions[c],sizeof(int) * seq_stats->alloc_len);
-                MMALLOC(seq_stats->errors[c],sizeof(float)* MAXERROR );
+                MMALLOC(seq_stats->errors[c],sizeof(long long int)* ERROR_BUCKETS );
+                MMALLOC(seq_stats->error_rate[c],sizeof(long long int)* ERROR_RATE_BINS );
 		
                 MMALLOC(seq_stats->seq_len[c],sizeof(int)* seq_stats->alloc_len);
                 MMALLOC(seq_stats->nuc_composition[c],sizeof(int*)* seq_stats->alloc_len);
-                MMALLOC(seq_stats->seq_quality[c],sizeof(long long int)* seq_stats->alloc_len);
-                MMALLOC(seq_stats->seq_quality_count[c],sizeof(long int)* seq_stats->alloc_len);
+                MMALLOC(seq_stats->qual_hist[c],sizeof(unsigned int)* seq_stats->alloc_len * QUAL_BINS);
+                memset(seq_stats->qual_hist[c], 0, sizeof(unsigned int)* seq_stats->alloc_len * QUAL_BINS);
 
 		
                 seq_stats->percent_identity[c] = 0.0f;
 		        
-                for(i = 0; i < MAXERROR;i++){
+                for(i = 0; i < ERROR_BUCKETS;i++){
                         seq_stats->errors[c][i] = 0;
-			
+                }
+                for(i = 0; i < ERROR_RATE_BINS;i++){
+                        seq_stats->error_rate[c][i] = 0;
                 }
 		
                 for(i= 0; i < seq_stats->alloc_len;i++){
@@ -1135,8 +1548,6 @@ struct seq_stats* init_seq_stats(void)
                         seq_stats->seq_len[c][i] = 0;
                         seq_stats->nuc_composition[c][i] = NULL;
 			
-                        seq_stats->seq_quality[c][i] = 0;
-                        seq_stats->seq_quality_count[c][i] = 0;
 			
                         MMALLOC(seq_stats->mismatches[c][i],sizeof(int)*5);
                         MMALLOC(seq_stats->insertions[c][i],sizeof(int)*5);
@@ -1170,6 +1581,68 @@ int clear_seq_stats(struct seq_stats* seq_stats)
         for(i= 0; i < 256;i++){
                 seq_stats->base_qualities[i] = 0;
         }
+        for(i = 0; i < seq_stats->alloc_contigs;i++){
+                for(c = 0; c < 6;c++){
+                        seq_stats->contig_alignments[i * 6 + c] = 0;
+                }
+                seq_stats->contig_errors[i] = 0;
+                seq_stats->contig_aln_len[i] = 0;
+        }
+        for(i = 0; i < seq_stats->alloc_tiles;i++){
+                seq_stats->tile_reads[i] = 0;
+                seq_stats->tile_qual_sum[i] = 0;
+                seq_stats->tile_qual_bases[i] = 0;
+                seq_stats->tile_errors[i] = 0;
+                seq_stats->tile_aln_len[i] = 0;
+        }
+        for(i = 0; i < 3;i++){
+                for(c = 0; c < 6;c++){
+                        for(j = 0; j < ISIZE_BUCKETS;j++){
+                                seq_stats->insert_size[i][c][j] = 0;
+                        }
+                }
+                seq_stats->insert_size_max[i] = 0;
+        }
+        for(c = 0; c < 6;c++){
+                RUN(clear_hll(seq_stats->dup_hll[c]));
+                seq_stats->dup_reads[c] = 0;
+        }
+        for(c = 0; c < 6;c++){
+                for(i = 0; i <= 100;i++){
+                        seq_stats->gc_content[c][i] = 0;
+                }
+        }
+        for(i = 0; i < 256;i++){
+                seq_stats->mapq_hist[i] = 0;
+        }
+        memset(seq_stats->calib_bases, 0, sizeof(long long int) * QUAL_BINS * MAX_SEQ_LEN);
+        memset(seq_stats->calib_mismatches, 0, sizeof(long long int) * QUAL_BINS * MAX_SEQ_LEN);
+        memset(seq_stats->subst, 0, sizeof(long long int) * MAX_SEQ_LEN * 16);
+        memset(seq_stats->context, 0, sizeof(long long int) * 64 * 4);
+        RUN(clear_cm_sketch(seq_stats->seq_cms));
+        RUN(clear_top_k(seq_stats->seq_top));
+        RUN(clear_top_k(seq_stats->junctions));
+        for(i = 0; i < 6;i++){
+                seq_stats->spliced_reads[i] = 0;
+        }
+        for(i = 0; i < INTRON_BUCKETS;i++){
+                seq_stats->intron_len[i] = 0;
+        }
+        for(i = 0; i < 2;i++){
+                for(j = 0; j < MAX_SEQ_LEN;j++){
+                        seq_stats->clip_pos[i][j] = 0;
+                        seq_stats->clip_len[i][j] = 0;
+                }
+        }
+        seq_stats->soft_clipped_reads = 0;
+        seq_stats->soft_clipped_bases = 0;
+        seq_stats->hard_clipped_reads = 0;
+        seq_stats->hard_clipped_bases = 0;
+        for(i = 0; i < NUM_ADAPTERS;i++){
+                for(j = 0; j < MAX_SEQ_LEN;j++){
+                        seq_stats->adapter_pos[i][j] = 0;
+                }
+        }
 	
         for(c = 0; c < 6;c++){
 		
@@ -1177,17 +1650,18 @@ int clear_seq_stats(struct seq_stats* seq_stats)
                 seq_stats->alignments[c] = 0;
                 seq_stats->percent_identity[c] = 0.0f;
 		
-                for(i = 0; i < MAXERROR;i++){
+                for(i = 0; i < ERROR_BUCKETS;i++){
                         seq_stats->errors[c][i] = 0;
-			
                 }
+                for(i = 0; i < ERROR_RATE_BINS;i++){
+                        seq_stats->error_rate[c][i] = 0;
+                }
+                memset(seq_stats->qual_hist[c], 0, sizeof(unsigned int)* seq_stats->alloc_len * QUAL_BINS);
 		
                 for(i= 0; i < MAX_SEQ_LEN;i++){
                         seq_stats->deletions[c][i] = 0;
                         seq_stats->seq_len[c][i] = 0;
 			
-                        seq_stats->seq_quality[c][i] = 0;
-                        seq_stats->seq_quality_count[c][i] = 0;
 			
                         for(j = 0; j < 5;j++){
                                 seq_stats->mismatches[c][i][j] = 0;
@@ -1233,66 +1707,1515 @@ void free_seq_stats(struct seq_stats* seq_stats)
                                 //free(seq_stats->seq_quality[i][j]);// = malloc(sizeof(int)* 6);
 			
                         }
-                        //free(seq_stats->seq_quality[i]);
                         free(seq_stats->seq_len[i]);// = malloc(sizeof(int)* MAX_SEQ_LEN);
                         free(seq_stats->nuc_composition[i]);// = malloc(sizeof(int*)* MAX_SEQ_LEN);
-                        free(seq_stats->seq_quality[i]);// = malloc(sizeof(int*)* MAX_SEQ_LEN);
-                        free(seq_stats->seq_quality_count[i]);
+                        free(seq_stats->qual_hist[i]);
                 }
                 for(i = 0; i < 6;i++){
                         free(seq_stats->errors[i]);
+                        free(seq_stats->error_rate[i]);
                         //free(seq_stats->percent_identity[i]);
 		
                 }
                 free(seq_stats->errors);
+                free(seq_stats->error_rate);
                 free(seq_stats->percent_identity);
                 free(seq_stats->base_qualities);
                 free(seq_stats->alignments);
                 free(seq_stats->nuc_num);
                 free(seq_stats->seq_len);// = malloc(sizeof(int*)* 6);
                 free(seq_stats->nuc_composition);// = malloc(sizeof(int**)* 6);
-                free(seq_stats->seq_quality);// = malloc(sizeof(int**)* 6);
-                free(seq_stats->seq_quality_count);
+                free(seq_stats->qual_hist);
                 free(seq_stats->aln_quality);// = malloc(sizeof(int)*6);
-                free(seq_stats);// = malloc(sizeof(struct seq_stats));
-        }
-}
-
-void print_stats(struct seq_stats* seq_stats)
-{
-        int i,j,c;
-	
-        int tmpmax= 0;
-	
-        if(seq_stats->max_len > MAX_SEQ_LEN){
-                tmpmax =seq_stats->max_len;
-                seq_stats->max_len = MAX_SEQ_LEN-1;
-        }
-	
-        fprintf(stderr,"Nucleotides:\n");
-        for(c = 0; c < 6;c++){
-                fprintf(stderr,"%d	%d\n",c,seq_stats->nuc_num[c]);
-        }
-	
-        fprintf(stderr,"Alignments :\n");
-        for(c = 0; c < 6;c++){
-                fprintf(stderr,"%d	%d\n",c,seq_stats->alignments[c]);
-        }
-	
-        fprintf(stderr,"Percentage Identitiy :\n");
-        for(c = 0; c < 6;c++){
-                fprintf(stderr,"%d	%f\n",c,seq_stats->percent_identity[c]);
-        }
-	
-        fprintf(stderr,"Errors :\n");
-        for(c = 0; c < 6;c++){
-                if(seq_stats->alignments[c]){
-                        fprintf(stderr,"Class:%d\n",c);
-                        for(i = 0; i < MAXERROR;i++){
-                                fprintf(stderr," %f",seq_stats->errors[c][i]);
-			
-                        }
-                        fprintf(stderr,"\n");
+                if(seq_stats->contig_alignments){
+                        MFREE(seq_stats->contig_alignments);
+                }
+                if(seq_stats->contig_errors){
+                        MFREE(seq_stats->contig_errors);
+                }
+                if(seq_stats->contig_aln_len){
+                        MFREE(seq_stats->contig_aln_len);
+                }
+                if(seq_stats->tile_reads){
+                        MFREE(seq_stats->tile_reads);
+                }
+                if(seq_stats->tile_qual_sum){
+                        MFREE(seq_stats->tile_qual_sum);
+                }
+                if(seq_stats->tile_qual_bases){
+                        MFREE(seq_stats->tile_qual_bases);
+                }
+                if(seq_stats->tile_errors){
+                        MFREE(seq_stats->tile_errors);
+                }
+                if(seq_stats->tile_aln_len){
+                        MFREE(seq_stats->tile_aln_len);
+                }
+                if(seq_stats->insert_size){
+                        for(i = 0; i < 3;i++){
+                                if(seq_stats->insert_size[i]){
+                                        for(j = 0; j < 6;j++){
+                                                if(seq_stats->insert_size[i][j]){
+                                                        MFREE(seq_stats->insert_size[i][j]);
+                                                }
+                                        }
+                                        MFREE(seq_stats->insert_size[i]);
+                                }
+                        }
+                        MFREE(seq_stats->insert_size);
+                }
+                if(seq_stats->insert_size_max){
+                        MFREE(seq_stats->insert_size_max);
+                }
+                if(seq_stats->dup_hll){
+                        for(i = 0; i < 6;i++){
+                                free_hll(seq_stats->dup_hll[i]);
+                        }
+                        MFREE(seq_stats->dup_hll);
+                }
+                if(seq_stats->dup_reads){
+                        MFREE(seq_stats->dup_reads);
+                }
+                if(seq_stats->mapq_hist){
+                        MFREE(seq_stats->mapq_hist);
+                }
+                if(seq_stats->calib_bases){
+                        MFREE(seq_stats->calib_bases);
+                }
+                if(seq_stats->calib_mismatches){
+                        MFREE(seq_stats->calib_mismatches);
+                }
+                if(seq_stats->subst){
+                        MFREE(seq_stats->subst);
+                }
+                if(seq_stats->context){
+                        MFREE(seq_stats->context);
+                }
+                if(seq_stats->gc_content){
+                        for(i = 0; i < 6;i++){
+                                if(seq_stats->gc_content[i]){
+                                        MFREE(seq_stats->gc_content[i]);
+                                }
+                        }
+                        MFREE(seq_stats->gc_content);
+                }
+                free_cm_sketch(seq_stats->seq_cms);
+                free_top_k(seq_stats->seq_top);
+                free_top_k(seq_stats->junctions);
+                if(seq_stats->spliced_reads){
+                        MFREE(seq_stats->spliced_reads);
+                }
+                if(seq_stats->intron_len){
+                        MFREE(seq_stats->intron_len);
+                }
+                if(seq_stats->clip_pos){
+                        for(i = 0; i < 2;i++){
+                                if(seq_stats->clip_pos[i]){
+                                        MFREE(seq_stats->clip_pos[i]);
+                                }
+                        }
+                        MFREE(seq_stats->clip_pos);
+                }
+                if(seq_stats->clip_len){
+                        for(i = 0; i < 2;i++){
+                                if(seq_stats->clip_len[i]){
+                                        MFREE(seq_stats->clip_len[i]);
+                                }
+                        }
+                        MFREE(seq_stats->clip_len);
+                }
+                if(seq_stats->adapter_pos){
+                        for(i = 0; i < NUM_ADAPTERS;i++){
+                                if(seq_stats->adapter_pos[i]){
+                                        MFREE(seq_stats->adapter_pos[i]);
+                                }
+                        }
+                        MFREE(seq_stats->adapter_pos);
+                }
+                free(seq_stats);// = malloc(sizeof(struct seq_stats));
+        }
+}
+
+/* Per-contig counters are indexed by the IDs handed out by the contig
+   table; grow them (zeroed) when a chunk introduces new contigs. */
+int resize_contig_stats(struct seq_stats* seq_stats,int num_contigs)
+{
+        int i,c;
+        int old = seq_stats->alloc_contigs;
+
+        if(num_contigs <= old){
+                return OK;
+        }
+        if(!seq_stats->alloc_contigs){
+                seq_stats->alloc_contigs = 64;
+        }
+        while(seq_stats->alloc_contigs < num_contigs){
+                seq_stats->alloc_contigs = seq_stats->alloc_contigs << 1;
+        }
+        MREALLOC(seq_stats->contig_alignments, sizeof(long long int) * seq_stats->alloc_contigs * 6);
+        MREALLOC(seq_stats->contig_errors, sizeof(long long int) * seq_stats->alloc_contigs);
+        MREALLOC(seq_stats->contig_aln_len, sizeof(long long int) * seq_stats->alloc_contigs);
+        for(i = old; i < seq_stats->alloc_contigs;i++){
+                for(c = 0; c < 6;c++){
+                        seq_stats->contig_alignments[i * 6 + c] = 0;
+                }
+                seq_stats->contig_errors[i] = 0;
+                seq_stats->contig_aln_len[i] = 0;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Same as resize_contig_stats for the tile IDs of param->tiles. */
+int resize_tile_stats(struct seq_stats* seq_stats,int num_tiles)
+{
+        int i;
+        int old = seq_stats->alloc_tiles;
+
+        if(num_tiles <= old){
+                return OK;
+        }
+        if(!seq_stats->alloc_tiles){
+                seq_stats->alloc_tiles = 64;
+        }
+        while(seq_stats->alloc_tiles < num_tiles){
+                seq_stats->alloc_tiles = seq_stats->alloc_tiles << 1;
+        }
+        MREALLOC(seq_stats->tile_reads, sizeof(long long int) * seq_stats->alloc_tiles);
+        MREALLOC(seq_stats->tile_qual_sum, sizeof(long long int) * seq_stats->alloc_tiles);
+        MREALLOC(seq_stats->tile_qual_bases, sizeof(long long int) * seq_stats->alloc_tiles);
+        MREALLOC(seq_stats->tile_errors, sizeof(long long int) * seq_stats->alloc_tiles);
+        MREALLOC(seq_stats->tile_aln_len, sizeof(long long int) * seq_stats->alloc_tiles);
+        for(i = old; i < seq_stats->alloc_tiles;i++){
+                seq_stats->tile_reads[i] = 0;
+                seq_stats->tile_qual_sum[i] = 0;
+                seq_stats->tile_qual_bases[i] = 0;
+                seq_stats->tile_errors[i] = 0;
+                seq_stats->tile_aln_len[i] = 0;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+struct contig_rank{
+        long long int reads;
+        int id;
+};
+
+static int qsort_contig_rank_cmp(const void *a, const void *b)
+{
+        const struct contig_rank* one = (const struct contig_rank*)a;
+        const struct contig_rank* two = (const struct contig_rank*)b;
+        if(one->reads != two->reads){
+                return one->reads < two->reads ? 1 : -1;
+        }
+        return one->id - two->id;
+}
+
+/* Contigs sorted by the number of reads: a bar chart of the top 20 split by
+   MAPQ and a table with counts, share of reads and error rate. */
+int print_contig_stats(FILE* outfile,struct seq_stats* seq_stats,struct contig_table* ct,struct plot_data* pd)
+{
+        struct contig_rank* rank = NULL;
+        long long int other[6];
+        long long int total;
+        int i,c,n,num_shown;
+
+        if(!ct->num_contigs){
+                return OK;
+        }
+        MMALLOC(rank, sizeof(struct contig_rank) * ct->num_contigs);
+        n = 0;
+        for(i = 0; i < ct->num_contigs;i++){
+                total = 0;
+                for(c = 0; c < 6;c++){
+                        total += seq_stats->contig_alignments[i * 6 + c];
+                }
+                if(total){
+                        rank[n].reads = total;
+                        rank[n].id = i;
+                        n++;
+                }
+        }
+        if(!n){
+                MFREE(rank);
+                return OK;
+        }
+        qsort(rank, n, sizeof(struct contig_rank), qsort_contig_rank_cmp);
+
+        num_shown = n;
+        if(num_shown > 20){
+                num_shown = 20;
+        }
+        if(num_shown > pd->org_num_points){
+                num_shown = pd->org_num_points;
+        }
+        for(i = 0; i < num_shown;i++){
+                snprintf(pd->labels[i], MAXLABEL_LEN, "%s", ct->names[rank[i].id]);
+                for(c = 0; c < 6;c++){
+                        pd->data[c][i] = 100.0 * (float)seq_stats->contig_alignments[rank[i].id * 6 + c] / (float)seq_stats->total_reads;
+                }
+        }
+        set_mapq_series_labels(pd);
+        for(c = 0; c < 6;c++){
+                pd->show_series[c] = seq_stats->alignments[c] ? 1 : 0;
+        }
+        pd->num_points = num_shown;
+        pd->num_points_shown = num_shown;
+        pd->num_series = 6;
+        pd->color_scheme = 0;
+        pd->width = 900;
+        pd->plot_type = BAR_PLOT;
+        sprintf(pd->plot_title, "Reads per Contig:");
+        sprintf(pd->description,"Percentage of all reads (y-axis) assigned to the %d contigs with the most reads (x-axis), split by mapping quality.", num_shown);
+        print_html5_chart(outfile, pd);
+        for(c = 0; c < 6;c++){
+                pd->show_series[c] = 1;
+        }
+
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td>Contig</td><td>Length</td><td>Reads</td><td>%% of reads</td>");
+        for(c = 0; c < 6;c++){
+                fprintf(outfile,"<td>");
+                print_html_escaped(outfile, mapq_label[c]);
+                fprintf(outfile,"</td>");
+        }
+        fprintf(outfile,"<td>Errors / 100bp</td></tr>\n");
+        num_shown = n;
+        if(num_shown > MAX_CONTIG_SHOWN){
+                num_shown = MAX_CONTIG_SHOWN;
+        }
+        for(i = 0; i < num_shown;i++){
+                fprintf(outfile,"<tr><td>");
+                print_html_escaped(outfile, ct->names[rank[i].id]);
+                fprintf(outfile,"</td><td>%d</td><td>%lld</td><td>%0.1f</td>", ct->len[rank[i].id], rank[i].reads,100.0 * (double)rank[i].reads / (double)seq_stats->total_reads);
+                for(c = 0; c < 6;c++){
+                        fprintf(outfile,"<td>%lld</td>",seq_stats->contig_alignments[rank[i].id * 6 + c]);
+                }
+                if(seq_stats->contig_aln_len[rank[i].id]){
+                        fprintf(outfile,"<td>%0.2f</td></tr>\n", 100.0 * (double)seq_stats->contig_errors[rank[i].id] / (double)seq_stats->contig_aln_len[rank[i].id]);
+                }else{
+                        fprintf(outfile,"<td>NA</td></tr>\n");
+                }
+        }
+        if(n > num_shown){
+                total = 0;
+                for(c = 0; c < 6;c++){
+                        other[c] = 0;
+                }
+                for(i = num_shown; i < n;i++){
+                        total += rank[i].reads;
+                        for(c = 0; c < 6;c++){
+                                other[c] += seq_stats->contig_alignments[rank[i].id * 6 + c];
+                        }
+                }
+                fprintf(outfile,"<tr><td>%d other contigs</td><td></td><td>%lld</td><td>%0.1f</td>", n - num_shown, total, 100.0 * (double)total / (double)seq_stats->total_reads);
+                for(c = 0; c < 6;c++){
+                        fprintf(outfile,"<td>%lld</td>",other[c]);
+                }
+                fprintf(outfile,"<td></td></tr>\n");
+        }
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        fprintf(outfile,"<p>Number of reads per contig in MAPQ intervals; errors per 100 aligned bases are taken from NM tags (or derived from MD / the reference).</p>\n");
+        MFREE(rank);
+        return OK;
+ERROR:
+        if(rank){
+                MFREE(rank);
+        }
+        return FAIL;
+}
+
+/* Aligned reads are keyed like Picard's MarkDuplicates: contig, unclipped
+   5' end (soft and hard clips included), strand and mate contig and
+   position. Unaligned reads (and fasta / fastq
+   input) fall back to a hash of the first DUP_PREFIX_LEN bases. Must be
+   called before reads on the negative strand are reverse complemented. */
+uint64_t duplicate_key(struct read_info* ri)
+{
+        const char* p = NULL;
+        int five_prime,op_len,ref_len,clip_start,clip_end;
+        uint64_t key;
+        uint64_t mate;
+
+        if(ri->contig == -1 || (ri->flag & 0x4) || !ri->cigar || ri->cigar[0] == '*'){
+                return hash_bytes64(ri->seq, ri->len < DUP_PREFIX_LEN ? ri->len : DUP_PREFIX_LEN);
+        }
+        ref_len = 0;
+        clip_start = 0;
+        clip_end = 0;
+        p = ri->cigar;
+        while(*p){
+                op_len = 0;
+                while(isdigit((int) *p)){
+                        op_len = op_len * 10 + (*p - '0');
+                        p++;
+                }
+                switch(*p){
+                case 'M':
+                case 'D':
+                case 'N':
+                case '=':
+                case 'X':
+                        ref_len += op_len;
+                        clip_end = 0;
+                        break;
+                case 'S':
+                case 'H':
+                        if(ref_len){
+                                clip_end += op_len;
+                        }else{
+                                clip_start += op_len;
+                        }
+                        break;
+                default:
+                        break;
+                }
+                if(*p){
+                        p++;
+                }
+        }
+        if(ri->strand){
+                five_prime = ri->pos + ref_len - 1 + clip_end;
+        }else{
+                five_prime = ri->pos - clip_start;
+        }
+        key = ((uint64_t)(uint32_t) ri->contig << 32) | (uint32_t) five_prime;
+        mate = ((uint64_t)(uint32_t) ri->mcontig << 32) | (uint32_t) ri->mpos;
+        return hash_mix64(key ^ hash_mix64(hash_mix64(mate) ^ (ri->strand ? 1 : 0)));
+}
+
+/* Estimated duplicate fraction per MAPQ class and overall (the union of the
+   per class sketches). */
+int print_duplicate_stats(FILE* outfile,struct seq_stats* seq_stats,struct plot_data* pd)
+{
+        struct hll* all = NULL;
+        long long int total = 0;
+        double distinct;
+        int c;
+
+        for(c = 0; c < 6;c++){
+                total += seq_stats->dup_reads[c];
+        }
+        if(!total){
+                return OK;
+        }
+        RUNP(all = init_hll(DUP_HLL_PRECISION));
+
+        sprintf(pd->labels[0], "%s","Reads");
+        sprintf(pd->labels[1], "%s","Distinct");
+        sprintf(pd->labels[2], "%s","Duplicates (%)");
+        set_mapq_series_labels(pd);
+        sprintf(pd->series_labels[6], "Total");
+        for(c = 0; c < 6;c++){
+                RUN(hll_merge(all, seq_stats->dup_hll[c]));
+                pd->show_series[c] = seq_stats->dup_reads[c] ? 1 : 0;
+                distinct = 0.0;
+                if(seq_stats->dup_reads[c]){
+                        distinct = hll_estimate(seq_stats->dup_hll[c]);
+                        if(distinct > (double) seq_stats->dup_reads[c]){
+                                distinct = (double) seq_stats->dup_reads[c];
+                        }
+                }
+                pd->data[c][0] = seq_stats->dup_reads[c];
+                pd->data[c][1] = distinct;
+                pd->data[c][2] = seq_stats->dup_reads[c] ? 100.0 * (1.0 - distinct / (double) seq_stats->dup_reads[c]) : 0.0;
+        }
+        distinct = hll_estimate(all);
+        if(distinct > (double) total){
+                distinct = (double) total;
+        }
+        pd->show_series[6] = 1;
+        pd->data[6][0] = total;
+        pd->data[6][1] = distinct;
+        pd->data[6][2] = 100.0 * (1.0 - distinct / (double) total);
+
+        pd->num_points = 3;
+        pd->num_points_shown = 3;
+        pd->num_series = 7;
+        pd->color_scheme = 4;
+        fprintf(outfile,"<h2>Duplication:</h2>\n");
+        sprintf(pd->description,"Estimated number of distinct reads and duplicate percentage in each mapping quality (MAPQ) interval. Aligned reads are duplicates if they share contig, unclipped 5' position, strand and mate contig and position (secondary and supplementary alignments are not counted); unaligned reads if they share the first %d bases. Estimates are made in fixed memory and are accurate to about 0.5%% of the number of distinct reads.", DUP_PREFIX_LEN);
+        print_html_table(outfile, pd);
+        for(c = 0; c < 7;c++){
+                pd->show_series[c] = 1;
+        }
+        free_hll(all);
+        return OK;
+ERROR:
+        free_hll(all);
+        return FAIL;
+}
+
+/* Returns the smallest quality bin at which the cumulative count reaches
+   fraction of total. */
+static int quality_quantile(unsigned int* hist,long long int total,double fraction)
+{
+        long long int sum = 0;
+        int i;
+        for(i = 0; i < QUAL_BINS;i++){
+                sum += hist[i];
+                if((double) sum >= fraction * (double) total){
+                        return i;
+                }
+        }
+        return QUAL_BINS - 1;
+}
+
+/* FastQC style summary of base qualities over all reads: 10th, 25th, 50th,
+   75th and 90th percentile per position, from the per position histograms
+   summed over MAPQ classes. */
+int print_quality_quantiles(FILE* outfile,struct seq_stats* seq_stats,struct plot_data* pd)
+{
+        unsigned int* hist = NULL;
+        double fraction[5] = {0.1,0.25,0.5,0.75,0.9};
+        int show[5];
+        long long int total;
+        int i,j,c;
+
+        MMALLOC(hist, sizeof(unsigned int) * QUAL_BINS);
+        sprintf(pd->series_labels[0], "10%%");
+        sprintf(pd->series_labels[1], "25%%");
+        sprintf(pd->series_labels[2], "Median");
+        sprintf(pd->series_labels[3], "75%%");
+        sprintf(pd->series_labels[4], "90%%");
+        for(j = 0; j < seq_stats->max_len;j++){
+                total = 0;
+                for(i = 0; i < QUAL_BINS;i++){
+                        hist[i] = 0;
+                        for(c = 0; c < 6;c++){
+                                hist[i] += seq_stats->qual_hist[c][j * QUAL_BINS + i];
+                        }
+                        total += hist[i];
+                }
+                for(i = 0; i < 5;i++){
+                        pd->data[i][j] = 0.0f;
+                        if(total){
+                                pd->data[i][j] = quality_quantile(hist, total, fraction[i]) + 33 - seq_stats->base_quality_offset;
+                        }
+                }
+        }
+        for(i = 0; i < 5;i++){
+                show[i] = pd->show_series[i];
+                pd->show_series[i] = 1;
+        }
+        pd->num_series = 5;
+        pd->color_scheme = 4;
+        pd->plot_type = LINE_PLOT;
+        sprintf(pd->description,"Percentiles of base qualities (y-axis) at each read position (x-axis) over all reads.");
+        sprintf(pd->plot_title, "Base Quality Percentiles");
+        print_html5_chart(outfile, pd);
+        for(i = 0; i < 5;i++){
+                pd->show_series[i] = show[i];
+        }
+        pd->num_series = 6;
+        MFREE(hist);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void print_html_escaped(FILE* outfile,const char* s)
+{
+        for(; *s;s++){
+                if(*s == '<'){
+                        fprintf(outfile,"&lt;");
+                }else if(*s == '>'){
+                        fprintf(outfile,"&gt;");
+                }else if(*s == '&'){
+                        fprintf(outfile,"&amp;");
+                }else{
+                        fputc(*s, outfile);
+                }
+        }
+}
+
+void init_mapq_classes(int* bounds)
+{
+        int i;
+        for(i = 0; i < 256;i++){
+                if(i == 0){
+                        mapq_class[i] = MAQ0;
+                }else if(i < bounds[0]){
+                        mapq_class[i] = MAQlt3;
+                }else if(i < bounds[1]){
+                        mapq_class[i] = MAQlt10;
+                }else if(i < bounds[2]){
+                        mapq_class[i] = MAQlt20;
+                }else if(i < bounds[3]){
+                        mapq_class[i] = MAQlt30;
+                }else{
+                        mapq_class[i] = MAQgt30;
+                }
+        }
+        snprintf(mapq_label[MAQgt30], MAXLABEL_LEN, "MAPQ >= %d", bounds[3]);
+        snprintf(mapq_label[MAQlt30], MAXLABEL_LEN, "MAPQ  < %2d", bounds[3]);
+        snprintf(mapq_label[MAQlt20], MAXLABEL_LEN, "MAPQ  < %2d", bounds[2]);
+        snprintf(mapq_label[MAQlt10], MAXLABEL_LEN, "MAPQ  < %2d", bounds[1]);
+        snprintf(mapq_label[MAQlt3], MAXLABEL_LEN, "MAPQ  < %2d", bounds[0]);
+        snprintf(mapq_label[MAQ0], MAXLABEL_LEN, "Unmapped");
+}
+
+void set_mapq_series_labels(struct plot_data* pd)
+{
+        int i;
+        for(i = 0; i < 6;i++){
+                sprintf(pd->series_labels[i], "%s", mapq_label[i]);
+        }
+}
+
+struct tile_rank{
+        const char* name;
+        int id;
+};
+
+static int qsort_tile_rank_cmp(const void *a, const void *b)
+{
+        const struct tile_rank* one = (const struct tile_rank*)a;
+        const struct tile_rank* two = (const struct tile_rank*)b;
+        return strcmp(one->name, two->name);
+}
+
+/* Mean base quality and error rate per flowcell:lane:tile. Cells are shaded
+   red when a tile is worse than the file as a whole: quality by up to 5
+   below the overall mean, errors by up to twice the overall rate. */
+int print_tile_stats(FILE* outfile,struct seq_stats* seq_stats,struct contig_table* tiles)
+{
+        struct tile_rank* order = NULL;
+        long long int qual_sum = 0;
+        long long int qual_bases = 0;
+        long long int errors = 0;
+        long long int aln_len = 0;
+        double mean_qual = 0.0;
+        double error_rate = 0.0;
+        /* tile_qual_sum holds raw - 33 like the other quality tables */
+        double qual_shift = 33.0 - (double) seq_stats->base_quality_offset;
+        double x;
+        int i,id,shade;
+
+        if(!tiles->num_contigs){
+                return OK;
+        }
+        MMALLOC(order, sizeof(struct tile_rank) * tiles->num_contigs);
+        for(i = 0; i < tiles->num_contigs;i++){
+                order[i].name = tiles->names[i];
+                order[i].id = i;
+                qual_sum += seq_stats->tile_qual_sum[i];
+                qual_bases += seq_stats->tile_qual_bases[i];
+                errors += seq_stats->tile_errors[i];
+                aln_len += seq_stats->tile_aln_len[i];
+        }
+        qsort(order, tiles->num_contigs, sizeof(struct tile_rank), qsort_tile_rank_cmp);
+        if(qual_bases){
+                mean_qual = (double) qual_sum / (double) qual_bases + qual_shift;
+        }
+        if(aln_len){
+                error_rate = 100.0 * (double) errors / (double) aln_len;
+        }
+
+        fprintf(outfile,"<h2>Tiles:</h2>\n");
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td>Flowcell:Lane:Tile</td><td>Reads</td><td>Mean base quality</td><td>Errors / 100bp</td></tr>\n");
+        for(i = 0; i < tiles->num_contigs;i++){
+                id = order[i].id;
+                fprintf(outfile,"<tr><td>");
+                print_html_escaped(outfile, tiles->names[id]);
+                fprintf(outfile,"</td><td>%lld</td>", seq_stats->tile_reads[id]);
+                if(seq_stats->tile_qual_bases[id]){
+                        x = (double) seq_stats->tile_qual_sum[id] / (double) seq_stats->tile_qual_bases[id] + qual_shift;
+                        shade = (int) (155.0 * (mean_qual - x) / 5.0);
+                        shade = shade < 0 ? 0 : (shade > 155 ? 155 : shade);
+                        fprintf(outfile,"<td style=\"background-color:rgb(255,%d,%d)\">%0.1f</td>", 255 - shade, 255 - shade, x);
+                }else{
+                        fprintf(outfile,"<td>n/a</td>");
+                }
+                if(seq_stats->tile_aln_len[id]){
+                        x = 100.0 * (double) seq_stats->tile_errors[id] / (double) seq_stats->tile_aln_len[id];
+                        shade = error_rate > 0.0 ? (int) (155.0 * (x / error_rate - 1.0)) : 0;
+                        shade = shade < 0 ? 0 : (shade > 155 ? 155 : shade);
+                        fprintf(outfile,"<td style=\"background-color:rgb(255,%d,%d)\">%0.2f</td>", 255 - shade, 255 - shade, x);
+                }else{
+                        fprintf(outfile,"<td>n/a</td>");
+                }
+                fprintf(outfile,"</tr>\n");
+        }
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        fprintf(outfile,"<p>Mean base quality and errors per 100 aligned bases for each tile, taken from Casava 1.8 read names (instrument:run:flowcell:lane:tile:x:y). Tiles are shaded red when they are worse than the whole file (mean base quality %0.1f, %0.2f errors / 100bp); local problems such as bubbles or flowcell defects show up as isolated red tiles.</p>\n", mean_qual, error_rate);
+        MFREE(order);
+        return OK;
+ERROR:
+        if(order){
+                MFREE(order);
+        }
+        return FAIL;
+}
+
+/* Phred score of mismatches / bases, with one pseudo count each way so
+   that bins without mismatches stay finite. */
+static inline double empirical_quality(long long int mismatches,long long int bases)
+{
+        return -10.0 * log10(((double) mismatches + 1.0) / ((double) bases + 2.0));
+}
+
+/* Reported against empirical base quality: the empirical quality of each
+   reported score (over all cycles), and by cycle the mean reported quality
+   next to the empirical quality. Both come from aligned bases with a known
+   reference base (MD tags or -ref). */
+int print_quality_calibration(FILE* outfile,struct seq_stats* seq_stats)
+{
+        struct plot_data* pd = NULL;
+        long long int bases,mismatches,qual_sum;
+        int q,pos,n,max_pos;
+        /* the table is indexed by raw - 33 */
+        int qual_shift = 33 - seq_stats->base_quality_offset;
+
+        RUNP(pd = malloc_plot_data(2, MAX_SEQ_LEN));
+        n = 0;
+        max_pos = -1;
+        for(q = 0; q < QUAL_BINS;q++){
+                bases = 0;
+                mismatches = 0;
+                for(pos = 0; pos < MAX_SEQ_LEN;pos++){
+                        bases += seq_stats->calib_bases[q * MAX_SEQ_LEN + pos];
+                        mismatches += seq_stats->calib_mismatches[q * MAX_SEQ_LEN + pos];
+                        if(seq_stats->calib_bases[q * MAX_SEQ_LEN + pos] && pos > max_pos){
+                                max_pos = pos;
+                        }
+                }
+                if(!bases){
+                        continue;
+                }
+                sprintf(pd->labels[n], "%d",q + qual_shift);
+                pd->data[0][n] = q + qual_shift;
+                pd->data[1][n] = empirical_quality(mismatches, bases);
+                n++;
+        }
+        if(!n){
+                free_plot_data(pd);
+                return OK;
+        }
+        sprintf(pd->series_labels[0], "Reported");
+        sprintf(pd->series_labels[1], "Empirical");
+        pd->show_series[0] = 1;
+        pd->show_series[1] = 1;
+        pd->num_points = n;
+        pd->num_points_shown = 20;
+        pd->num_series = 2;
+        pd->color_scheme = 0;
+        pd->width = 900;
+        pd->plot_type = LINE_PLOT;
+        sprintf(pd->plot_title, "Base Quality Calibration:");
+        sprintf(pd->description,"Reported base quality (x-axis) against the empirical quality -10 log10(mismatches / aligned bases) of bases with that score (y-axis). Empirical values below the reported ones mean the base qualities are too optimistic.");
+        print_html5_chart(outfile, pd);
+
+        for(pos = 0; pos <= max_pos;pos++){
+                bases = 0;
+                mismatches = 0;
+                qual_sum = 0;
+                for(q = 0; q < QUAL_BINS;q++){
+                        bases += seq_stats->calib_bases[q * MAX_SEQ_LEN + pos];
+                        mismatches += seq_stats->calib_mismatches[q * MAX_SEQ_LEN + pos];
+                        qual_sum += seq_stats->calib_bases[q * MAX_SEQ_LEN + pos] * q;
+                }
+                sprintf(pd->labels[pos], "%dnt",pos+1);
+                pd->data[0][pos] = bases ? (double) qual_sum / (double) bases + qual_shift : 0.0;
+                pd->data[1][pos] = bases ? empirical_quality(mismatches, bases) : 0.0;
+        }
+        sprintf(pd->series_labels[0], "Mean reported");
+        pd->num_points = max_pos + 1;
+        sprintf(pd->plot_title, "Base Quality Calibration by Cycle:");
+        sprintf(pd->description,"Mean reported base quality and empirical quality (y-axis) of aligned bases at each read position (x-axis).");
+        print_html5_chart(outfile, pd);
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+/* Reference to read substitutions (in read orientation): the overall 4x4
+   matrix, the rate of each of the 12 substitutions by read position and
+   mismatch rates by trinucleotide context of the reference base. C>T at
+   the read ends points to deamination, G>T to oxidative damage (8-oxoG). */
+int print_substitution_stats(FILE* outfile,struct seq_stats* seq_stats)
+{
+        static const char* nuc = "ACGT";
+        struct plot_data* pd = NULL;
+        long long int total[16];
+        long long int ref_total;
+        int i,j,c,pos,max_pos;
+
+        for(i = 0; i < 16;i++){
+                total[i] = 0;
+        }
+        max_pos = -1;
+        for(pos = 0; pos < MAX_SEQ_LEN;pos++){
+                for(i = 0; i < 16;i++){
+                        total[i] += seq_stats->subst[pos * 16 + i];
+                        if(seq_stats->subst[pos * 16 + i]){
+                                max_pos = pos;
+                        }
+                }
+        }
+        if(max_pos == -1){
+                return OK;
+        }
+
+        fprintf(outfile,"<h2>Substitutions:</h2>\n");
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td>Reference \\ Read</td><td>A</td><td>C</td><td>G</td><td>T</td></tr>\n");
+        for(i = 0; i < 4;i++){
+                ref_total = total[i * 4] + total[i * 4 + 1] + total[i * 4 + 2] + total[i * 4 + 3];
+                fprintf(outfile,"<tr><td>%c</td>", nuc[i]);
+                for(j = 0; j < 4;j++){
+                        if(i == j){
+                                fprintf(outfile,"<td>%lld</td>", total[i * 4 + j]);
+                        }else{
+                                fprintf(outfile,"<td>%lld (%0.3f%%)</td>", total[i * 4 + j], ref_total ? 100.0 * (double) total[i * 4 + j] / (double) ref_total : 0.0);
+                        }
+                }
+                fprintf(outfile,"</tr>\n");
+        }
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        fprintf(outfile,"<p>Aligned bases by reference base (rows) and read base (columns), both in read orientation; percentages are of all aligned bases with that reference base.</p>\n");
+
+        RUNP(pd = malloc_plot_data(12, MAX_SEQ_LEN));
+        c = 0;
+        for(i = 0; i < 4;i++){
+                for(j = 0; j < 4;j++){
+                        if(i == j){
+                                continue;
+                        }
+                        sprintf(pd->series_labels[c], "%c>%c", nuc[i], nuc[j]);
+                        pd->show_series[c] = 1;
+                        for(pos = 0; pos <= max_pos;pos++){
+                                ref_total = seq_stats->subst[pos * 16 + i * 4] + seq_stats->subst[pos * 16 + i * 4 + 1] + seq_stats->subst[pos * 16 + i * 4 + 2] + seq_stats->subst[pos * 16 + i * 4 + 3];
+                                pd->data[c][pos] = ref_total ? 100.0 * (double) seq_stats->subst[pos * 16 + i * 4 + j] / (double) ref_total : 0.0;
+                        }
+                        c++;
+                }
+        }
+        for(pos = 0; pos <= max_pos;pos++){
+                sprintf(pd->labels[pos], "%dnt",pos+1);
+        }
+        pd->num_points = max_pos + 1;
+        pd->num_points_shown = 20;
+        pd->num_series = 12;
+        pd->color_scheme = 0;
+        pd->width = 900;
+        pd->plot_type = LINE_PLOT;
+        sprintf(pd->plot_title, "Substitution Rates by Position:");
+        sprintf(pd->description,"Percentage of aligned bases with a given reference base (y-axis) read as another base, by read position (x-axis).");
+        print_html5_chart(outfile, pd);
+
+        for(i = 0; i < 64;i++){
+                sprintf(pd->labels[i], "%c%c%c", nuc[i >> 4], nuc[(i >> 2) & 3], nuc[i & 3]);
+                ref_total = seq_stats->context[i * 4] + seq_stats->context[i * 4 + 1] + seq_stats->context[i * 4 + 2] + seq_stats->context[i * 4 + 3];
+                for(j = 0; j < 4;j++){
+                        pd->data[j][i] = 0.0;
+                        if(ref_total && j != ((i >> 2) & 3)){
+                                pd->data[j][i] = 100.0 * (double) seq_stats->context[i * 4 + j] / (double) ref_total;
+                        }
+                }
+        }
+        for(j = 0; j < 4;j++){
+                sprintf(pd->series_labels[j], "to %c", nuc[j]);
+                pd->show_series[j] = 1;
+        }
+        pd->num_points = 64;
+        pd->num_series = 4;
+        pd->plot_type = BAR_PLOT;
+        sprintf(pd->plot_title, "Mismatches by Sequence Context:");
+        sprintf(pd->description,"Percentage of aligned bases read as A, C, G or T (y-axis) when they differ from the middle reference base of the trinucleotide (x-axis), in read orientation.");
+        print_html5_chart(outfile, pd);
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+/* Errors per read for each mapped MAPQ class (exact up to ERROR_EXACT, log
+   buckets beyond) followed by the distribution of per read error rates,
+   which unlike raw counts can be compared across read lengths. */
+int print_error_stats(FILE* outfile,struct seq_stats* seq_stats)
+{
+        struct plot_data* pd = NULL;
+        long long int start,end;
+        int i,j,max;
+
+        if(seq_stats->max_error_per_read < 0){
+                return OK;
+        }
+        RUNP(pd = malloc_plot_data(6, ERROR_BUCKETS > ERROR_RATE_BINS ? ERROR_BUCKETS : ERROR_RATE_BINS));
+        pd->color_scheme = 0;
+
+        max = log_bucket(seq_stats->max_error_per_read, ERROR_EXACT_BITS, ERROR_SUB_BITS);
+        for(j = 0; j <= max;j++){
+                start = log_bucket_start(j, ERROR_EXACT_BITS, ERROR_SUB_BITS);
+                end = log_bucket_start(j+1, ERROR_EXACT_BITS, ERROR_SUB_BITS) - 1;
+                if(start == end){
+                        sprintf(pd->labels[j], "%lld",start);
+                }else{
+                        sprintf(pd->labels[j], "%lld-%lld",start,end);
+                }
+        }
+        for(i = 0; i < 5;i++){
+                if(!seq_stats->alignments[i]){
+                        continue;
+                }
+                sprintf(pd->plot_title, "Number of Errors Per Read (%s):", mapq_label[i]);
+                sprintf(pd->description,"Barplot shows the percentage of reads (y-axis) with 0, 1, 2 ... errors (x axis) for %s reads. Above %d errors reads are grouped into ranges.", mapq_label[i], ERROR_EXACT - 1);
+                for(j = 0; j <= max;j++){
+                        pd->data[0][j] = 100.0 * (float)seq_stats->errors[i][j]/ (float)seq_stats->alignments[i];
+                }
+                sprintf(pd->series_labels[0],"Errors");
+                pd->show_series[0] = 1;
+                pd->num_points = max + 1;
+                pd->num_series = 1;
+                pd->width = 300;
+                pd->num_points_shown = 10;
+                pd->plot_type = BAR_PLOT;
+                print_html5_chart(outfile, pd);
+        }
+
+        max = -1;
+        for(i = 0; i < 5;i++){
+                pd->show_series[i] = 0;
+                for(j = 0; j < ERROR_RATE_BINS;j++){
+                        if(seq_stats->error_rate[i][j]){
+                                pd->show_series[i] = 1;
+                                if(j > max){
+                                        max = j;
+                                }
+                        }
+                }
+        }
+        if(max != -1){
+                set_mapq_series_labels(pd);
+                for(j = 0; j <= max;j++){
+                        if(j == ERROR_RATE_BINS-1){
+                                sprintf(pd->labels[j], ">=100%%");
+                        }else{
+                                sprintf(pd->labels[j], "%0.1f%%", (float) j * 0.5f);
+                        }
+                        for(i = 0; i < 5;i++){
+                                pd->data[i][j] = 0.0;
+                                if(seq_stats->alignments[i]){
+                                        pd->data[i][j] = 100.0 * (float)seq_stats->error_rate[i][j]/ (float)seq_stats->alignments[i];
+                                }
+                        }
+                }
+                pd->num_points = max + 1;
+                pd->num_series = 5;
+                pd->width = 900;
+                pd->num_points_shown = 20;
+                pd->plot_type = LINE_PLOT;
+                sprintf(pd->plot_title, "Error Rate Per Read:");
+                sprintf(pd->description,"Percentage of reads (y-axis) by errors per aligned base (x-axis, in 0.5%% steps) in each MAPQ interval.");
+                print_html5_chart(outfile, pd);
+        }
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+/* Full MAPQ distribution (0 to the highest MAPQ seen). */
+int print_mapq_histogram(FILE* outfile,struct seq_stats* seq_stats)
+{
+        struct plot_data* pd = NULL;
+        int i,max;
+
+        max = 0;
+        for(i = 0; i < 256;i++){
+                if(seq_stats->mapq_hist[i]){
+                        max = i;
+                }
+        }
+        if(!max || !seq_stats->total_reads){
+                return OK;
+        }
+        RUNP(pd = malloc_plot_data(1, max + 1));
+        for(i = 0; i <= max;i++){
+                sprintf(pd->labels[i], "%d",i);
+                pd->data[0][i] = 100.0 * (float) seq_stats->mapq_hist[i] / (float) seq_stats->total_reads;
+        }
+        sprintf(pd->series_labels[0], "Reads");
+        pd->num_points = max + 1;
+        pd->num_points_shown = 20;
+        pd->num_series = 1;
+        pd->color_scheme = 0;
+        pd->width = 900;
+        pd->plot_type = BAR_PLOT;
+        sprintf(pd->plot_title, "MAPQ Distribution:");
+        sprintf(pd->description,"Percentage of reads (y-axis) with each mapping quality (x-axis).");
+        print_html5_chart(outfile, pd);
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+/* Distribution of per read GC content (of the A/C/G/T bases) for each MAPQ
+   interval. */
+int print_gc_stats(FILE* outfile,struct seq_stats* seq_stats)
+{
+        struct plot_data* pd = NULL;
+        long long int reads[6];
+        int i,c,any;
+
+        any = 0;
+        for(c = 0; c < 6;c++){
+                reads[c] = 0;
+                for(i = 0; i <= 100;i++){
+                        reads[c] += seq_stats->gc_content[c][i];
+                }
+                any += reads[c] ? 1 : 0;
+        }
+        if(!any){
+                return OK;
+        }
+        RUNP(pd = malloc_plot_data(6, 101));
+        set_mapq_series_labels(pd);
+        for(i = 0; i <= 100;i++){
+                sprintf(pd->labels[i], "%d",i);
+        }
+        for(c = 0; c < 6;c++){
+                pd->show_series[c] = reads[c] ? 1 : 0;
+                for(i = 0; i <= 100;i++){
+                        pd->data[c][i] = reads[c] ? 100.0 * (float) seq_stats->gc_content[c][i] / (float) reads[c] : 0.0f;
+                }
+        }
+        pd->num_points = 101;
+        pd->num_points_shown = 20;
+        pd->num_series = 6;
+        pd->color_scheme = 0;
+        pd->width = 900;
+        pd->plot_type = LINE_PLOT;
+        sprintf(pd->plot_title, "GC Content per Read:");
+        sprintf(pd->description,"Percentage of reads (y-axis) with a given GC content (x-axis, %% of A, C, G and T bases) in each MAPQ interval. Extra peaks often point to contamination.");
+        print_html5_chart(outfile, pd);
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+struct overrep_rank{
+        long long int count;
+        int id;
+};
+
+static int qsort_overrep_rank_cmp(const void *a, const void *b)
+{
+        const struct overrep_rank* one = (const struct overrep_rank*)a;
+        const struct overrep_rank* two = (const struct overrep_rank*)b;
+        if(one->count != two->count){
+                return one->count < two->count ? 1 : -1;
+        }
+        return one->id - two->id;
+}
+
+/* Soft clipping by read position and clip length, separately for the 5'
+   and 3' end of reads, and the number of hard clipped reads. */
+int print_clip_stats(FILE* outfile,struct seq_stats* seq_stats)
+{
+        struct plot_data* pd = NULL;
+        long long int mapped = 0;
+        int i,c,max;
+
+        for(i = 0; i < 5;i++){
+                mapped += seq_stats->alignments[i];
+        }
+        if(!mapped || (!seq_stats->soft_clipped_reads && !seq_stats->hard_clipped_reads)){
+                return OK;
+        }
+        fprintf(outfile,"<h2>Clipping:</h2>\n");
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td></td><td>Reads</td><td>%% of aligned reads</td><td>Bases</td></tr>\n");
+        fprintf(outfile,"<tr><td>Soft clipped</td><td>%lld</td><td>%0.2f</td><td>%lld</td></tr>\n", seq_stats->soft_clipped_reads, 100.0 * (double) seq_stats->soft_clipped_reads / (double) mapped, seq_stats->soft_clipped_bases);
+        fprintf(outfile,"<tr><td>Hard clipped</td><td>%lld</td><td>%0.2f</td><td>%lld</td></tr>\n", seq_stats->hard_clipped_reads, 100.0 * (double) seq_stats->hard_clipped_reads / (double) mapped, seq_stats->hard_clipped_bases);
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        fprintf(outfile,"<p>Aligned reads with soft (CIGAR S) or hard (CIGAR H) clipped bases.</p>\n");
+        if(!seq_stats->soft_clipped_reads){
+                return OK;
+        }
+
+        RUNP(pd = malloc_plot_data(2, MAX_SEQ_LEN));
+        sprintf(pd->series_labels[0], "5' clip");
+        sprintf(pd->series_labels[1], "3' clip");
+        pd->show_series[0] = 1;
+        pd->show_series[1] = 1;
+        pd->num_series = 2;
+        pd->num_points_shown = 20;
+        pd->color_scheme = 0;
+        pd->width = 900;
+
+        max = 0;
+        for(c = 0; c < 2;c++){
+                for(i = 0; i < MAX_SEQ_LEN;i++){
+                        if(seq_stats->clip_pos[c][i] && i > max){
+                                max = i;
+                        }
+                }
+        }
+        for(i = 0; i <= max;i++){
+                sprintf(pd->labels[i], "%dnt",i+1);
+                for(c = 0; c < 2;c++){
+                        pd->data[c][i] = 100.0 * (double) seq_stats->clip_pos[c][i] / (double) mapped;
+                }
+        }
+        pd->num_points = max + 1;
+        pd->plot_type = LINE_PLOT;
+        sprintf(pd->plot_title, "Soft Clipping by Position:");
+        sprintf(pd->description,"Percentage of aligned reads (y-axis) soft clipped at each read position (x-axis) from the 5' and the 3' end.");
+        print_html5_chart(outfile, pd);
+
+        max = 0;
+        for(c = 0; c < 2;c++){
+                for(i = 1; i < MAX_SEQ_LEN;i++){
+                        if(seq_stats->clip_len[c][i] && i > max){
+                                max = i;
+                        }
+                }
+        }
+        for(i = 1; i <= max;i++){
+                if(i == MAX_SEQ_LEN-1){
+                        sprintf(pd->labels[i-1], ">=%d",i);
+                }else{
+                        sprintf(pd->labels[i-1], "%d",i);
+                }
+                for(c = 0; c < 2;c++){
+                        pd->data[c][i-1] = 100.0 * (double) seq_stats->clip_len[c][i] / (double) mapped;
+                }
+        }
+        pd->num_points = max;
+        pd->plot_type = BAR_PLOT;
+        sprintf(pd->plot_title, "Soft Clip Lengths:");
+        sprintf(pd->description,"Percentage of aligned reads (y-axis) with a soft clip of a given length (x-axis) at the 5' and the 3' end.");
+        print_html5_chart(outfile, pd);
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+/* Spliced reads per MAPQ class, the intron length distribution and the
+   most frequent splice junctions. */
+int print_splice_stats(FILE* outfile,struct seq_stats* seq_stats,struct contig_table* ct)
+{
+        struct top_k* tk = seq_stats->junctions;
+        struct overrep_rank* rank = NULL;
+        struct plot_data* pd = NULL;
+        long long int start,end;
+        long long int total = 0;
+        long long int introns = 0;
+        int junction[3];
+        int i,max,n;
+
+        for(i = 0; i < 6;i++){
+                total += seq_stats->spliced_reads[i];
+        }
+        if(!total){
+                return OK;
+        }
+        fprintf(outfile,"<h2>Spliced Reads:</h2>\n");
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td>MAPQ</td><td>Reads</td><td>Spliced</td><td>%% Spliced</td></tr>\n");
+        for(i = 0; i < 5;i++){
+                if(!seq_stats->alignments[i]){
+                        continue;
+                }
+                fprintf(outfile,"<tr><td>");
+                print_html_escaped(outfile, mapq_label[i]);
+                fprintf(outfile,"</td><td>%d</td><td>%lld</td><td>%0.2f</td></tr>\n", seq_stats->alignments[i], seq_stats->spliced_reads[i], 100.0 * (double) seq_stats->spliced_reads[i] / (double) seq_stats->alignments[i]);
+        }
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        fprintf(outfile,"<p>Number and percentage of aligned reads with at least one skipped region (CIGAR N) in each MAPQ interval.</p>\n");
+
+        max = 0;
+        for(i = 0; i < INTRON_BUCKETS;i++){
+                introns += seq_stats->intron_len[i];
+                if(seq_stats->intron_len[i]){
+                        max = i;
+                }
+        }
+        RUNP(pd = malloc_plot_data(1, max + 1));
+        for(i = 0; i <= max;i++){
+                start = log_bucket_start(i, INTRON_EXACT_BITS, INTRON_SUB_BITS);
+                end = log_bucket_start(i+1, INTRON_EXACT_BITS, INTRON_SUB_BITS) - 1;
+                if(start == end){
+                        sprintf(pd->labels[i], "%lld",start);
+                }else{
+                        sprintf(pd->labels[i], "%lld-%lld",start,end);
+                }
+                pd->data[0][i] = 100.0 * (double) seq_stats->intron_len[i] / (double) introns;
+        }
+        sprintf(pd->series_labels[0], "Introns");
+        pd->show_series[0] = 1;
+        pd->num_points = max + 1;
+        pd->num_points_shown = 20;
+        pd->num_series = 1;
+        pd->color_scheme = 0;
+        pd->width = 900;
+        pd->plot_type = BAR_PLOT;
+        sprintf(pd->plot_title, "Intron Lengths:");
+        sprintf(pd->description,"Percentage of skipped regions (CIGAR N, y-axis) by length (x-axis); above %d bases lengths are grouped into ranges.", (1 << INTRON_EXACT_BITS) - 1);
+        print_html5_chart(outfile, pd);
+        free_plot_data(pd);
+        pd = NULL;
+
+        MMALLOC(rank, sizeof(struct overrep_rank) * (tk->n + 1));
+        for(i = 0; i < tk->n;i++){
+                rank[i].count = tk->count[i];
+                rank[i].id = i;
+        }
+        qsort(rank, tk->n, sizeof(struct overrep_rank), qsort_overrep_rank_cmp);
+        n = tk->n < JUNCTION_MAX_SHOWN ? tk->n : JUNCTION_MAX_SHOWN;
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td>Contig</td><td>Intron start</td><td>Intron end</td><td>Length</td><td>Reads</td></tr>\n");
+        for(i = 0; i < n;i++){
+                memcpy(junction, tk->seq + (size_t) rank[i].id * tk->seq_len, sizeof(junction));
+                fprintf(outfile,"<tr><td>");
+                print_html_escaped(outfile, ct->names[junction[0]]);
+                fprintf(outfile,"</td><td>%d</td><td>%d</td><td>%d</td><td>%lld</td></tr>\n", junction[1] + 1, junction[2] + 1, junction[2] - junction[1] + 1, rank[i].count);
+        }
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        if(tk->n == tk->k){
+                fprintf(outfile,"<p>The %d most frequent splice junctions (1 based intron coordinates). More than %d distinct junctions were seen; counts are estimated in fixed memory and may be overestimates for junctions with few reads.</p>\n", n, JUNCTION_TOP_K);
+        }else{
+                fprintf(outfile,"<p>The %d most frequent of %d splice junctions (1 based intron coordinates).</p>\n", n, tk->n);
+        }
+        MFREE(rank);
+        return OK;
+ERROR:
+        if(rank){
+                MFREE(rank);
+        }
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+/* Table of sequences (first OVERREP_LEN bases) seen in more than
+   OVERREP_MIN_FRACTION of reads, with adapters they contain, followed by the
+   cumulative percentage of reads with each adapter by position. Counts are
+   the smaller of the Space-Saving and count-min upper bounds. */
+int print_overrepresented_stats(FILE* outfile,struct seq_stats* seq_stats,struct plot_data* pd)
+{
+        struct top_k* tk = seq_stats->seq_top;
+        struct overrep_rank* rank = NULL;
+        char* seq = NULL;
+        const char* s = NULL;
+        char* alphabet = "ACGTN";
+        long long int sum;
+        long long int count;
+        unsigned int kmer;
+        int i,j,a,n,len,valid,hits;
+
+        if(!seq_stats->total_reads){
+                return OK;
+        }
+        MMALLOC(rank, sizeof(struct overrep_rank) * (tk->n + 1));
+        MMALLOC(seq, sizeof(char) * (tk->seq_len + 1));
+        n = 0;
+        for(i = 0; i < tk->n;i++){
+                count = cm_sketch_estimate(seq_stats->seq_cms, tk->key[i]);
+                if(tk->count[i] < count){
+                        count = tk->count[i];
+                }
+                if((double) count >= OVERREP_MIN_FRACTION * (double) seq_stats->total_reads && count > 1){
+                        rank[n].count = count;
+                        rank[n].id = i;
+                        n++;
+                }
+        }
+        qsort(rank, n, sizeof(struct overrep_rank), qsort_overrep_rank_cmp);
+
+        if(n){
+                fprintf(outfile,"<h2>Overrepresented Sequences:</h2>\n");
+                fprintf(outfile,"<table  class=\"simple\" >\n");
+                fprintf(outfile,"<tr><td>Sequence</td><td>Count</td><td>Percentage</td><td>Possible Source</td></tr>\n");
+                if(n > OVERREP_MAX_SHOWN){
+                        n = OVERREP_MAX_SHOWN;
+                }
+                for(i = 0; i < n;i++){
+                        len = tk->seq_len_used[rank[i].id];
+                        s = tk->seq + (size_t) rank[i].id * tk->seq_len;
+                        for(j = 0; j < len;j++){
+                                seq[j] = alphabet[(s[j] >= 0 && s[j] < 4) ? (int) s[j] : 4];
+                        }
+                        seq[len] = 0;
+                        fprintf(outfile,"<tr><td style=\"font-family:monospace\">%s</td><td>%lld</td><td>%0.2f</td><td>", seq, rank[i].count, 100.0 * (double) rank[i].count / (double) seq_stats->total_reads);
+                        hits = 0;
+                        kmer = 0;
+                        valid = 0;
+                        for(j = 0; j < len;j++){
+                                if(s[j] < 0 || s[j] > 3){
+                                        valid = 0;
+                                        continue;
+                                }
+                                kmer = ((kmer << 2) | (unsigned int) s[j]) & ((1u << (2 * ADAPTER_K)) - 1);
+                                if(++valid < ADAPTER_K){
+                                        continue;
+                                }
+                                for(a = 0; a < NUM_ADAPTERS;a++){
+                                        if(kmer == adapter_code[a] && !(hits & (1 << a))){
+                                                fprintf(outfile,"%s%s", hits ? ", " : "", adapter_names[a]);
+                                                hits |= 1 << a;
+                                        }
+                                }
+                        }
+                        fprintf(outfile,"%s</td></tr>\n", hits ? "" : "No Hit");
+                }
+                fprintf(outfile,"</table>\n");
+                fprintf(outfile,"<div style=\"clear:both;\"></div>");
+                fprintf(outfile,"<p>Sequences making up at least %0.1f%% of all reads (first %d bases of each read). Counts are estimated in fixed memory and may be slight overestimates.</p>\n", 100.0 * OVERREP_MIN_FRACTION, OVERREP_LEN);
+        }
+
+        hits = 0;
+        for(a = 0; a < NUM_ADAPTERS;a++){
+                sum = 0;
+                for(j = 0; j < seq_stats->max_len;j++){
+                        sum += seq_stats->adapter_pos[a][j];
+                        sprintf(pd->labels[j], "%d",j+1);
+                        pd->data[a][j] = 100.0 * (float) sum / (float) seq_stats->total_reads;
+                }
+                snprintf(pd->series_labels[a], MAXLABEL_LEN, "%s", adapter_names[a]);
+                pd->show_series[a] = sum ? 1 : 0;
+                hits += sum ? 1 : 0;
+        }
+        if(hits){
+                pd->num_points = seq_stats->max_len;
+                pd->num_points_shown = 20;
+                pd->num_series = NUM_ADAPTERS;
+                pd->color_scheme = 4;
+                pd->width = 900;
+                pd->plot_type = LINE_PLOT;
+                sprintf(pd->plot_title, "Adapter Content:");
+                sprintf(pd->description,"Cumulative percentage of reads (y-axis) in which the first %d bases of an adapter were seen at or before each position (x-axis).", ADAPTER_K);
+                print_html5_chart(outfile, pd);
+        }else{
+                fprintf(outfile,"<h2>Adapter Content: No adapter sequences found</h2>\n");
+        }
+        for(a = 0; a < NUM_ADAPTERS;a++){
+                pd->show_series[a] = 1;
+        }
+        MFREE(rank);
+        MFREE(seq);
+        return OK;
+ERROR:
+        if(rank){
+                MFREE(rank);
+        }
+        if(seq){
+                MFREE(seq);
+        }
+        return FAIL;
+}
+
+/* Returns the start of the bucket holding the given fraction of pairs. */
+static long long int insert_size_quantile(long long int* hist,long long int total,double fraction)
+{
+        long long int sum = 0;
+        int i;
+        for(i = 0; i < ISIZE_BUCKETS;i++){
+                sum += hist[i];
+                if((double) sum >= fraction * (double) total){
+                        return insert_size_bucket_start(i);
+                }
+        }
+        return insert_size_bucket_start(ISIZE_BUCKETS-1);
+}
+
+/* Insert size distribution for each pair orientation with pairs, split by
+   MAPQ, followed by Picard style summary numbers (median, median absolute
+   deviation, mean and standard deviation). Above ISIZE_EXACT these are
+   only as precise as the log buckets. */
+int print_insert_size_stats(FILE* outfile,struct seq_stats* seq_stats)
+{
+        struct plot_data* pd = NULL;
+        char* orientation[3] = {"FR","RF","FF"};
+        long long int* hist = NULL;
+        long long int* dev = NULL;
+        long long int pairs[6];
+        long long int total,median,x;
+        double mean,sd;
+        int i,j,c,o,width,any;
+
+        any = 0;
+        for(o = 0; o < 3;o++){
+                any += seq_stats->insert_size_max[o];
+        }
+        if(!any){
+                return OK;
+        }
+        RUNP(pd = malloc_plot_data(6, ISIZE_PLOT_POINTS));
+        MMALLOC(hist, sizeof(long long int) * ISIZE_BUCKETS);
+        MMALLOC(dev, sizeof(long long int) * ISIZE_BUCKETS);
+
+        set_mapq_series_labels(pd);
+
+        for(o = 0; o < 3;o++){
+                if(!seq_stats->insert_size_max[o]){
+                        continue;
+                }
+                total = 0;
+                for(j = 0; j < ISIZE_BUCKETS;j++){
+                        hist[j] = 0;
+                }
+                for(c = 0; c < 6;c++){
+                        pairs[c] = 0;
+                        for(j = 0; j < ISIZE_BUCKETS;j++){
+                                hist[j] += seq_stats->insert_size[o][c][j];
+                                pairs[c] += seq_stats->insert_size[o][c][j];
+                        }
+                        total += pairs[c];
+                        pd->show_series[c] = pairs[c] ? 1 : 0;
+                }
+                /* plot up to the 99th percentile */
+                width = (int)((insert_size_quantile(hist, total, 0.99) + ISIZE_PLOT_POINTS) / ISIZE_PLOT_POINTS);
+                for(i = 0; i < ISIZE_PLOT_POINTS;i++){
+                        sprintf(pd->labels[i], "%d", i * width);
+                        for(c = 0; c < 6;c++){
+                                pd->data[c][i] = 0.0f;
+                        }
+                }
+                for(j = 0; j < ISIZE_BUCKETS;j++){
+                        i = (int)(insert_size_bucket_start(j) / width);
+                        if(i >= ISIZE_PLOT_POINTS){
+                                break;
+                        }
+                        for(c = 0; c < 6;c++){
+                                if(pairs[c]){
+                                        pd->data[c][i] += 100.0 * (float)seq_stats->insert_size[o][c][j] / (float)pairs[c];
+                                }
+                        }
+                }
+                pd->num_points = ISIZE_PLOT_POINTS;
+                pd->num_points_shown = 20;
+                pd->num_series = 6;
+                pd->color_scheme = 0;
+                pd->width = 900;
+                pd->plot_type = LINE_PLOT;
+                sprintf(pd->plot_title, "Insert Size (%s pairs):", orientation[o]);
+                sprintf(pd->description,"Percentage of %s read pairs (y-axis) by insert size (x-axis) in each MAPQ interval, up to the 99th percentile.", orientation[o]);
+                print_html5_chart(outfile, pd);
+        }
+
+        fprintf(outfile,"<table  class=\"simple\" >\n");
+        fprintf(outfile,"<tr><td>Orientation</td><td>MAPQ</td><td>Pairs</td><td>Median</td><td>MAD</td><td>Mean</td><td>SD</td><td>Max</td></tr>\n");
+        for(o = 0; o < 3;o++){
+                for(c = 0; c < 6;c++){
+                        total = 0;
+                        mean = 0.0;
+                        for(j = 0; j < ISIZE_BUCKETS;j++){
+                                total += seq_stats->insert_size[o][c][j];
+                                mean += (double)seq_stats->insert_size[o][c][j] * insert_size_bucket_mid(j);
+                        }
+                        if(!total){
+                                continue;
+                        }
+                        mean /= (double) total;
+                        sd = 0.0;
+                        median = insert_size_quantile(seq_stats->insert_size[o][c], total, 0.5);
+                        for(j = 0; j < ISIZE_BUCKETS;j++){
+                                dev[j] = 0;
+                        }
+                        for(j = 0; j < ISIZE_BUCKETS;j++){
+                                sd += (double)seq_stats->insert_size[o][c][j] * (insert_size_bucket_mid(j) - mean) * (insert_size_bucket_mid(j) - mean);
+                                x = insert_size_bucket_start(j);
+                                x = x > median ? x - median : median - x;
+                                if(x >= INT_MAX){
+                                        x = INT_MAX - 1;
+                                }
+                                dev[insert_size_bucket((int) x)] += seq_stats->insert_size[o][c][j];
+                        }
+                        sd = total > 1 ? sqrt(sd / (double)(total - 1)) : 0.0;
+                        fprintf(outfile,"<tr><td>%s</td><td>", orientation[o]);
+                        print_html_escaped(outfile, pd->series_labels[c]);
+                        fprintf(outfile,"</td><td>%lld</td><td>%lld</td><td>%lld</td><td>%0.1f</td><td>%0.1f</td><td>%d</td></tr>\n", total, median, insert_size_quantile(dev, total, 0.5), mean, sd, seq_stats->insert_size_max[o]);
+                }
+        }
+        fprintf(outfile,"</table>\n");
+        fprintf(outfile,"<div style=\"clear:both;\"></div>");
+        fprintf(outfile,"<p>Insert size summary for mapped read pairs with both mates on the same contig, by pair orientation (FR: forward-reverse, RF: reverse-forward, FF: tandem) and MAPQ of the leftmost mate. MAD is the median absolute deviation; Max is the largest insert size seen across all MAPQ intervals.</p>\n");
+
+        MFREE(hist);
+        MFREE(dev);
+        free_plot_data(pd);
+        return OK;
+ERROR:
+        if(hist){
+                MFREE(hist);
+        }
+        if(dev){
+                MFREE(dev);
+        }
+        if(pd){
+                free_plot_data(pd);
+        }
+        return FAIL;
+}
+
+void print_stats(struct seq_stats* seq_stats)
+{
+        int i,j,c;
+	
+        int tmpmax= 0;
+	
+        if(seq_stats->max_len > MAX_SEQ_LEN){
+                tmpmax =seq_stats->max_len;
+                seq_stats->max_len = MAX_SEQ_LEN-1;
+        }
+	
+        fprintf(stderr,"Nucleotides:\n");
+        for(c = 0; c < 6;c++){
+                fprintf(stderr,"%d	%d\n",c,seq_stats->nuc_num[c]);
+        }
+	
+        fprintf(stderr,"Alignments :\n");
+        for(c = 0; c < 6;c++){
+                fprintf(stderr,"%d	%d\n",c,seq_stats->alignments[c]);
+        }
+	
+        fprintf(stderr,"Percentage Identitiy :\n");
+        for(c = 0; c < 6;c++){
+                fprintf(stderr,"%d	%f\n",c,seq_stats->percent_identity[c]);
+        }
+	
+        fprintf(stderr,"Errors :\n");
+        for(c = 0; c < 6;c++){
+                if(seq_stats->alignments[c]){
+                        fprintf(stderr,"Class:%d\n",c);
+                        for(i = 0; i < ERROR_BUCKETS;i++){
+                                fprintf(stderr," %lld",seq_stats->errors[c][i]);
+			
+                        }
+                        fprintf(stderr,"\n");
                 }
         }
 	
@@ -1302,7 +3225,12 @@ void print_stats(struct seq_stats* seq_stats)
                         fprintf(stderr,"Class:%d\n",c);
                         for(i= 0; i <= seq_stats->max_len;i++){
 			
-                                fprintf(stderr," %lld",seq_stats->seq_quality[c][i] );
+                                for(j = 0; j < QUAL_BINS;j++){
+                                        if(seq_stats->qual_hist[c][i * QUAL_BINS + j]){
+                                                fprintf(stderr," %d:%u",j,seq_stats->qual_hist[c][i * QUAL_BINS + j]);
+                                        }
+                                }
+                                fprintf(stderr,";");
 			
                         }
                         fprintf(stderr,"\n");
@@ -1374,205 +3302,205 @@ void print_stats(struct seq_stats* seq_stats)
 
 
 
-int parse_cigar_md(struct read_info* ri,struct seq_stats* seq_stats,int qual_key)
+/* Reads a run length from a CIGAR / MD string and advances the pointer. */
+static inline int read_run_length(const char** p)
 {
-        int* read = malloc(sizeof(int)* MAX_SEQ_LEN);
-        int* genome = malloc(sizeof(int) * MAX_SEQ_LEN);
-        int reverse_int[5]  ={3,2,1,0,4};
-        char tmp_num[8];
-        int l,i,j,c,rp,gp,sp,exit_loop,aln_len,add;
-	
-        for(i = 0; i < MAX_SEQ_LEN;i++){
-                genome[i] = 0;
-                read[i] = 0;
+        const char* s = *p;
+        int n = 0;
+        while((unsigned int)(*s - '0') < 10u){
+                n = n * 10 + (*s - '0');
+                s++;
+        }
+        *p = s;
+        return n;
+}
+
+/* Walks the CIGAR operations and MD tokens together in a single pass and
+   updates the mismatch / insertion / deletion profiles directly. Without an
+   MD tag the read is compared against the reference contig (if given,
+   contig != -1) starting at POS. Positions are reported relative to the 5'
+   end of the read; columns past MAX_SEQ_LEN are walked but not recorded.
+   Returns the number of alignment columns (M/=/X/I/D). */
+int parse_cigar_md(struct read_info* ri,struct seq_stats* seq_stats,struct reference* ref,int contig,int qual_key)
+{
+        static const int reverse_int[5]  ={3,2,1,0,4};
+        struct ref_cursor rc = {NULL, 0, 0, 1, 0};
+        const char* cigar = ri->cigar;
+        const char* md = ri->md;
+        const int len = ri->len;
+        const int strand = ri->strand;
+        const char* qual = (ri->qual && ri->qual[0] != '*') ? ri->qual : NULL;
+        int md_run = 0;
+        /* reference bases two and one positions back and the read base one
+           back; the trinucleotide context of a base is only known once the
+           next reference base has been seen. */
+        int ref0 = -1;
+        int ref1 = -1;
+        int base1 = -1;
+        int junction[3];
+        int spliced = 0;
+        int soft_clipped = 0;
+        int hard_clipped = 0;
+        int op_len,j,rp,gp,pos,aln_len,base,ref_base,c;
+	
+        if(md){
+                md_run = read_run_length(&md);
+        }else if(contig != -1){
+                ref_cursor_set(&rc, ref, contig, ri->pos - 1);
         }
-	
-	
-        l = (int) strlen((char*)ri->cigar);
-        exit_loop = 0;
-        i =0;
         rp = 0;
-        sp = 0;
-        while(!exit_loop){
-                c = 0;
-                if(isdigit((int)ri->cigar[i])){
-                        j = 0;
-                        while (isdigit(ri->cigar[i])) {
-                                tmp_num[j] = ri->cigar[i];
-                                j++;
-                                i++;
-                                if(i == l){
-                                        exit_loop =1;
-                                        break;
+        gp = ri->pos - 1;
+        aln_len = 0;
+        while(*cigar){
+                op_len = read_run_length(&cigar);
+                switch (*cigar) {
+                case 'M':
+                case '=':
+                case 'X':
+                        for(j = 0; j < op_len && rp < len;j++){
+                                ref_base = -1;
+                                base = ri->seq[rp];
+                                if(base > 4){
+                                        base = 4;
                                 }
-                        }
-                        tmp_num[j] = 0;
-			
-                        c = atoi(tmp_num);
-                }
-                if(isalpha((int)ri->cigar[i])){
-                        switch (ri->cigar[i]) {
-                                // Sum of lengths of the M/I/S/=/X operations shall equal the length of SEQ.
-					
-                        case 'M':
-                        case 'S':
-                        case '=':
-                        case 'X':
-                                for(j = 0; j < c;j++){
-                                        read[rp] = ri->seq[sp];
-                                        rp++;
-                                        sp++;
-                                }
-                                //			fprintf(stderr,"M:%d\n",c);
-                                break;
-                        case 'I':
-                                for(j = 0; j < c;j++){
-                                        read[rp] = ri->seq[sp];
-                                        genome[rp] = -1;
-                                        rp++;
-                                        sp++;
+                                if(md){
+                                        if(md_run){
+                                                md_run--;
+                                                ref_base = base;
+                                        }else if(isalpha((int)*md)){
+                                                ref_base = nuc_code[(int)*md];
+                                                md++;
+                                                md_run = read_run_length(&md);
+                                        }else{
+                                                /* MD out of sync with the CIGAR - stop using it. */
+                                                md = NULL;
+                                        }
+                                }else if(contig != -1){
+                                        ref_base = nuc_code[(int)ref_cursor_next(&rc)];
                                 }
-					
-                                //			fprintf(stderr,"I:%d\n",c);
-                                break;
-                        case 'D':
-                                for(j = 0; j < c;j++){
-                                        read[rp] = -1;
-                                        rp++;
-						
+                                if(ref_base != -1){
+                                        pos = strand ? len-1-rp : rp;
+                                        if(base != ref_base && pos < MAX_SEQ_LEN){
+                                                seq_stats->mismatches[qual_key][pos][strand ? reverse_int[base] : base] += 1;
+                                        }
+                                        if(base < 4 && ref_base < 4){
+                                                if(pos < MAX_SEQ_LEN){
+                                                        if(qual){
+                                                                c = qual_bin[(unsigned char) qual[rp]] * MAX_SEQ_LEN + pos;
+                                                                seq_stats->calib_bases[c]++;
+                                                                if(base != ref_base){
+                                                                        seq_stats->calib_mismatches[c]++;
+                                                                }
+                                                        }
+                                                        if(strand){
+                                                                seq_stats->subst[pos * 16 + (3 - ref_base) * 4 + 3 - base]++;
+                                                        }else{
+                                                                seq_stats->subst[pos * 16 + ref_base * 4 + base]++;
+                                                        }
+                                                }
+                                        }
+                                        if(ref0 >= 0 && ref1 < 4 && ref_base < 4 && base1 < 4){
+                                                if(strand){
+                                                        seq_stats->context[((3 - ref_base) * 16 + (3 - ref1) * 4 + 3 - ref0) * 4 + 3 - base1]++;
+                                                }else{
+                                                        seq_stats->context[(ref0 * 16 + ref1 * 4 + ref_base) * 4 + base1]++;
+                                                }
+                                        }
+                                        ref0 = ref1 < 4 ? ref1 : -1;
+                                        ref1 = ref_base;
+                                        base1 = base;
+                                }else{
+                                        ref0 = -1;
+                                        ref1 = -1;
                                 }
-					
-                                //			fprintf(stderr,"D:%d\n",c);
-                                break;
-                        default:
-                                break;
+                                rp++;
                         }
-                        c = 0;
-                }
-                i++;
-                if(i == l){
-                        exit_loop =1;
+                        gp += op_len;
+                        aln_len += op_len;
                         break;
-                }
-		
-        }
-        aln_len = rp;
-        i =0;
-        rp = 0;
-	
-        while(read[rp] == -1){
-                rp++;
-        }
-        gp = 0;
-        exit_loop = 0;
-        add  = 0;
-        l = (int) strlen((char*)ri->md);
-	
-        //int gg;
-	
-        //#1C20^ATT0C3A0
-        while(!exit_loop){
-                if(isdigit((int)ri->md[i])){
-                        j = 0;
-                        while (isdigit(ri->md[i])) {
-                                tmp_num[j] = ri->md[i];
-                                j++;
-                                i++;
-                                if(i == l){
-                                        exit_loop = 1;
-                                        break;
+                case 'I':
+                        for(j = 0; j < op_len && rp < len;j++){
+                                pos = strand ? len-1-rp : rp;
+                                if(pos < MAX_SEQ_LEN){
+                                        base = ri->seq[rp];
+                                        if(base > 4){
+                                                base = 4;
+                                        }
+                                        seq_stats->insertions[qual_key][pos][strand ? reverse_int[base] : base] += 1;
                                 }
+                                rp++;
                         }
-                        tmp_num[j] = 0;
-			
-                        c = atoi(tmp_num);
-			
-                        //fprintf(stderr,"MD:%d\n",c);
-                        for(j = 0; j < c;j++){
-                                while(genome[gp] == -1){
-                                        gp++;
-                                        rp++;
-                                }
-                                while(read[rp] == -1){
-                                        rp++;
+                        aln_len += op_len;
+                        break;
+                case 'D':
+                        pos = strand ? len-1-rp : rp;
+                        if(pos >= 0 && pos < MAX_SEQ_LEN){
+                                seq_stats->deletions[qual_key][pos] += op_len;
+                        }
+                        if(md){
+                                if(*md == '^'){
+                                        md++;
                                 }
-                                genome[gp] = read[rp];
-				
-                                gp++;
-                                rp++;
-                                //fprintf(stderr,"%d	%d	%d \n",aln_len,rp,i);
-                                while(read[rp] == -1){
-                                        rp++;
+                                while(isalpha((int)*md)){
+                                        md++;
                                 }
+                                md_run = read_run_length(&md);
                         }
-                        add = 0;
-                }else if(isalpha((int)ri->md[i])){
-                        //fprintf(stderr,"MD:%c\n",ri->md[i]);
-                        while(genome[gp] == -1){
-                                gp++;
+                        gp += op_len;
+                        if(contig != -1){
+                                ref_cursor_set(&rc, ref, contig, gp);
                         }
-                        genome[gp] = nuc_code[(int)ri->md[i]];
-                        gp++;
-                        i++;
-                        if(!add){
-                                rp++;
+                        aln_len += op_len;
+                        break;
+                case 'N':
+                        if(!spliced){
+                                seq_stats->spliced_reads[qual_key]++;
+                                spliced = 1;
+                        }
+                        seq_stats->intron_len[log_bucket(op_len, INTRON_EXACT_BITS, INTRON_SUB_BITS)]++;
+                        if(ri->contig != -1){
+                                junction[0] = ri->contig;
+                                junction[1] = gp;
+                                junction[2] = gp + op_len - 1;
+                                top_k_add(seq_stats->junctions, hash_bytes64((const char*) junction, sizeof(junction)), (const char*) junction, sizeof(junction));
+                        }
+                        gp += op_len;
+                        if(contig != -1){
+                                ref_cursor_set(&rc, ref, contig, gp);
                         }
-			
-                }else{
-                        add = 1;
-                        i++;
-                }
-                if(i == l){
-                        exit_loop = 1;
                         break;
-                }
-        }
-	
-        if(ri->strand == 0){
-                gp = 0;
-                for(i =0;i < aln_len;i++){
-			
-                        if(read[i] != -1 && genome[i] != -1){
-                                if(read[i] != genome[i]){
-                                        seq_stats->mismatches[qual_key][gp][read[i]] += 1;
+                case 'S':
+                        /* a clip at the start of SEQ is the 5' end of forward reads and the 3' end of reverse ones */
+                        c = ((rp == 0) ^ strand) ? 0 : 1;
+                        seq_stats->clip_len[c][op_len < MAX_SEQ_LEN ? op_len : MAX_SEQ_LEN-1]++;
+                        for(j = 0; j < op_len && rp < len;j++){
+                                pos = strand ? len-1-rp : rp;
+                                if(pos < MAX_SEQ_LEN){
+                                        seq_stats->clip_pos[c][pos]++;
                                 }
-                                gp++;
-                                //			fprintf(stderr,"Mismatch %d\n",i);
-                        }else if(read[i] == -1 && genome[i] != -1){
-                                seq_stats->deletions[qual_key][gp] += 1;
-				
-                                //			fprintf(stderr,"Deletion %d\n",i);
-                        }else if(read[i] != -1 && genome[i] == -1){
-                                seq_stats->insertions[qual_key][gp][read[i]] += 1;
-                                gp++;
-                                //			fprintf(stderr,"Insertion %d\n",i);
+                                rp++;
                         }
+                        seq_stats->soft_clipped_bases += op_len;
+                        soft_clipped = 1;
+                        break;
+                case 'H':
+                        seq_stats->hard_clipped_bases += op_len;
+                        hard_clipped = 1;
+                        break;
+                default:
+                        /* P consumes neither read, reference nor MD. */
+                        break;
                 }
-        }else{
-                gp = ri->len-1;
-                for(i = 0;i < aln_len;i++){
-			
-                        if(read[i] != -1 && genome[i] != -1){
-                                if(read[i] != genome[i]){
-                                        seq_stats->mismatches[qual_key][gp][reverse_int[read[i]]] += 1;
-                                        //		fprintf(stderr,"Mismatch %d->%d\n",i,gp);
-                                }
-                                gp--;
-				
-                        }else if(read[i] == -1 && genome[i] != -1){
-                                seq_stats->deletions[qual_key][gp] += 1;
-				
-                                //	fprintf(stderr,"Deletion %d\n",i);
-                        }else if(read[i] != -1 && genome[i] == -1){
-                                seq_stats->insertions[qual_key][gp][reverse_int[read[i]]] += 1;
-                                gp--;
-                                //	fprintf(stderr,"Insertion %d\n",i);
-                        }
+                if(*cigar != 'M' && *cigar != '=' && *cigar != 'X'){
+                        ref0 = -1;
+                        ref1 = -1;
+                }
+                if(*cigar){
+                        cigar++;
                 }
         }
-	
-        free(read);
-        free(genome);
+        seq_stats->soft_clipped_reads += soft_clipped;
+        seq_stats->hard_clipped_reads += hard_clipped;
         return aln_len;
 }
 
@@ -0,0 +1,255 @@
+#include "samstat.h"
+#include "misc.h"
+#include "ref.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static int read_fai(struct reference* ref,char* filename);
+static int build_fai(struct reference* ref);
+static int add_contig(struct reference* ref,const char* name,int name_len,long long int offset,int len,int line_bases,int line_width);
+static int qsort_contig_cmp(const void *a, const void *b);
+
+struct reference* load_reference(char* filename)
+{
+        struct reference* ref = NULL;
+        struct ref_contig* c = NULL;
+        struct stat buf;
+        char* fai_name = NULL;
+        int i;
+
+        ASSERT(filename != NULL, "No reference file");
+
+        MMALLOC(ref, sizeof(struct reference));
+        ref->contigs = NULL;
+        ref->map = NULL;
+        ref->map_size = 0;
+        ref->num_contigs = 0;
+        ref->alloc_contigs = 256;
+        ref->fd = -1;
+
+        MMALLOC(ref->contigs, sizeof(struct ref_contig*) * ref->alloc_contigs);
+
+        if((ref->fd = open(filename, O_RDONLY)) == -1){
+                ERROR_MSG("Cannot open reference file: %s",filename);
+        }
+        if(fstat(ref->fd, &buf) != 0){
+                ERROR_MSG("Cannot stat reference file: %s",filename);
+        }
+        ref->map_size = (size_t) buf.st_size;
+        ASSERT(ref->map_size != 0, "Reference file %s is empty.", filename);
+        ref->map = mmap(NULL, ref->map_size, PROT_READ, MAP_PRIVATE, ref->fd, 0);
+        if(ref->map == MAP_FAILED){
+                ref->map = NULL;
+                ERROR_MSG("Cannot memory map reference file: %s",filename);
+        }
+        ASSERT(ref->map[0] == '>', "Reference file %s does not look like (uncompressed) fasta.", filename);
+
+        MMALLOC(fai_name, sizeof(char) * (strlen(filename) + 5));
+        sprintf(fai_name,"%s.fai",filename);
+        if(file_exists(fai_name)){
+                RUN(read_fai(ref, fai_name));
+        }else{
+                RUN(build_fai(ref));
+        }
+        MFREE(fai_name);
+
+        ASSERT(ref->num_contigs != 0, "No sequences found in reference file: %s", filename);
+        qsort(ref->contigs, ref->num_contigs, sizeof(struct ref_contig*), qsort_contig_cmp);
+
+        /* the last base of a contig sits past the newline padding of all
+           full lines before it */
+        for(i = 0; i < ref->num_contigs;i++){
+                c = ref->contigs[i];
+                ASSERT(c->offset >= 0 && c->len >= 0,"Bad index entry for %s.", c->name);
+                ASSERT(c->line_width >= c->line_bases,"Index entry for %s has fewer bytes than bases per line.", c->name);
+                if(c->len){
+                        ASSERT(c->offset + (long long int)((c->len - 1) / c->line_bases) * c->line_width + (c->len - 1) % c->line_bases + 1 <= (long long int) ref->map_size,"Index entry for %s extends past the end of the reference file.", c->name);
+                }
+        }
+        return ref;
+ERROR:
+        if(fai_name){
+                MFREE(fai_name);
+        }
+        free_reference(ref);
+        return NULL;
+}
+
+void free_reference(struct reference* ref)
+{
+        int i;
+        if(ref){
+                if(ref->contigs){
+                        for(i = 0; i < ref->num_contigs;i++){
+                                MFREE(ref->contigs[i]->name);
+                                MFREE(ref->contigs[i]);
+                        }
+                        MFREE(ref->contigs);
+                }
+                if(ref->map){
+                        munmap(ref->map, ref->map_size);
+                }
+                if(ref->fd != -1){
+                        close(ref->fd);
+                }
+                MFREE(ref);
+        }
+}
+
+/* Returns the index of the named contig or -1; contigs are sorted by name. */
+int reference_contig(struct reference* ref,const char* name)
+{
+        int lo = 0;
+        int hi = ref->num_contigs - 1;
+        int mid,c;
+        while(lo <= hi){
+                mid = (lo + hi) >> 1;
+                c = strcmp(name, ref->contigs[mid]->name);
+                if(c == 0){
+                        return mid;
+                }else if(c < 0){
+                        hi = mid - 1;
+                }else{
+                        lo = mid + 1;
+                }
+        }
+        return -1;
+}
+
+static int read_fai(struct reference* ref,char* filename)
+{
+        FILE* f_ptr = NULL;
+        char* line = NULL;
+        size_t line_len = 0;
+        char* tab = NULL;
+        long long int offset;
+        int len,line_bases,line_width;
+
+        if((f_ptr = fopen(filename, "r")) == NULL){
+                ERROR_MSG("Cannot open index file: %s",filename);
+        }
+        while(getline(&line, &line_len, f_ptr) != -1){
+                if((tab = strchr(line, '\t')) == NULL){
+                        continue;
+                }
+                if(sscanf(tab+1,"%d\t%lld\t%d\t%d", &len, &offset, &line_bases, &line_width) != 4){
+                        ERROR_MSG("Malformed line in index file %s: %s",filename,line);
+                }
+                RUN(add_contig(ref, line, (int)(tab - line), offset, len, line_bases, line_width));
+        }
+        MFREE(line);
+        fclose(f_ptr);
+        return OK;
+ERROR:
+        if(line){
+                MFREE(line);
+        }
+        if(f_ptr){
+                fclose(f_ptr);
+        }
+        return FAIL;
+}
+
+/* No .fai next to the fasta file - index the mapped file in memory. Like
+   samtools faidx, all lines of a sequence but the last must have the same
+   length; blank lines are only allowed after the last one. */
+static int build_fai(struct reference* ref)
+{
+        const char* p = ref->map;
+        const char* end = ref->map + ref->map_size;
+        const char* name = NULL;
+        const char* line_end = NULL;
+        long long int offset = 0;
+        int name_len = 0;
+        int len = 0;
+        int line_bases = 0;
+        int line_width = 0;
+        int last_line = 0;
+        int n;
+
+        while(p < end){
+                line_end = memchr(p, '\n', end - p);
+                if(!line_end){
+                        line_end = end;
+                }
+                if(*p == '>'){
+                        if(name){
+                                RUN(add_contig(ref, name, name_len, offset, len, line_bases, line_width));
+                        }
+                        name = p + 1;
+                        name_len = 0;
+                        while(name + name_len < line_end && !isspace((int) name[name_len])){
+                                name_len++;
+                        }
+                        offset = (line_end - ref->map) + 1;
+                        len = 0;
+                        line_bases = 0;
+                        line_width = 0;
+                        last_line = 0;
+                }else{
+                        n = (int)(line_end - p);
+                        if(n && p[n-1] == '\r'){
+                                n--;
+                        }
+                        if(n){
+                                if(last_line || (line_bases && (n > line_bases || (n == line_bases && (int)(line_end - p) + 1 != line_width)))){
+                                        ERROR_MSG("Sequence %.*s in the reference has lines of different length (or blank lines); rewrap it to a fixed line length or index it with samtools faidx.", name ? name_len : 1, name ? name : "?");
+                                }
+                                if(!line_bases){
+                                        line_bases = n;
+                                        line_width = (int)(line_end - p) + 1;
+                                }else if(n < line_bases){
+                                        last_line = 1;
+                                }
+                                len += n;
+                        }else{
+                                last_line = 1;
+                        }
+                }
+                p = line_end + 1;
+        }
+        if(name){
+                RUN(add_contig(ref, name, name_len, offset, len, line_bases, line_width));
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+static int add_contig(struct reference* ref,const char* name,int name_len,long long int offset,int len,int line_bases,int line_width)
+{
+        struct ref_contig* c = NULL;
+
+        if(ref->num_contigs == ref->alloc_contigs){
+                ref->alloc_contigs = ref->alloc_contigs << 1;
+                MREALLOC(ref->contigs, sizeof(struct ref_contig*) * ref->alloc_contigs);
+        }
+        MMALLOC(c, sizeof(struct ref_contig));
+        c->name = NULL;
+        MMALLOC(c->name, sizeof(char) * (name_len + 1));
+        memcpy(c->name, name, name_len);
+        c->name[name_len] = 0;
+        c->offset = offset;
+        c->len = len;
+        c->line_bases = line_bases;
+        c->line_width = line_width;
+        if(c->line_bases <= 0){
+                c->line_bases = 1;
+                c->line_width = 1;
+                c->len = 0;
+        }
+        ref->contigs[ref->num_contigs] = c;
+        ref->num_contigs++;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+static int qsort_contig_cmp(const void *a, const void *b)
+{
+        const struct ref_contig* const* one = (const struct ref_contig* const*)a;
+        const struct ref_contig* const* two = (const struct ref_contig* const*)b;
+        return strcmp((*one)->name, (*two)->name);
+}
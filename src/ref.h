@@ -0,0 +1,68 @@
+#ifndef REF_HEADER
+
+#define REF_HEADER
+
+/* Reference sequences are memory mapped and accessed through a samtools
+   style .fai index (name, length, offset, bases per line, bytes per line). */
+
+struct ref_contig{
+        char* name;
+        long long int offset;
+        int len;
+        int line_bases;
+        int line_width;
+};
+
+struct reference{
+        struct ref_contig** contigs;
+        char* map;
+        size_t map_size;
+        int num_contigs;
+        int alloc_contigs;
+        int fd;
+};
+
+/* Sequential access to one contig; avoids a division per base. */
+struct ref_cursor{
+        const char* p;
+        int line_left;
+        int line_pad;
+        int line_bases;
+        int left;
+};
+
+struct reference* load_reference(char* filename);
+void free_reference(struct reference* ref);
+int reference_contig(struct reference* ref,const char* name);
+
+static inline void ref_cursor_set(struct ref_cursor* rc,struct reference* ref,int contig, int pos)
+{
+        const struct ref_contig* c = ref->contigs[contig];
+        if(pos < 0 || pos >= c->len){
+                rc->left = 0;
+                return;
+        }
+        rc->p = ref->map + c->offset + (long long int)(pos / c->line_bases) * c->line_width + pos % c->line_bases;
+        rc->line_left = c->line_bases - pos % c->line_bases;
+        rc->line_pad = c->line_width - c->line_bases;
+        rc->line_bases = c->line_bases;
+        rc->left = c->len - pos;
+}
+
+/* Returns the reference letter under the cursor and moves one base on; 'N' past the contig end. */
+static inline char ref_cursor_next(struct ref_cursor* rc)
+{
+        char c;
+        if(rc->left <= 0){
+                return 'N';
+        }
+        c = *rc->p++;
+        rc->left--;
+        if(--rc->line_left == 0){
+                rc->p += rc->line_pad;
+                rc->line_left = rc->line_bases;
+        }
+        return c;
+}
+
+#endif
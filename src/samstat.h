@@ -19,11 +19,14 @@
 #include <getopt.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 
 #include "tldevel.h"
 #include "thr_pool.h"
 
 
+struct contig_table;
+
 struct parameters {
         char** infile; /**< @brief Names of input files. */
         char* outfile;
@@ -34,6 +37,13 @@ struct parameters {
         char* filter;
         char* train;
         char* exact5;
+        char* reference;/**< @brief Reference fasta used when reads lack MD tags. */
+        struct contig_table* contigs;/**< @brief Reference names of the current input file. */
+        int mapq_bounds[4];/**< @brief Ascending upper bounds (exclusive) of the MAPQ classes above 0. */
+        struct contig_table* tiles;/**< @brief flowcell:lane:tile IDs parsed from read names (-tiles), otherwise NULL. */
+        int tile_stats;
+        int hmm_sample;/**< @brief Reads per MAPQ group kept for HMM training (-sample). */
+        int hmm_sample_mem;/**< @brief Megabytes of read sequence the three training samples may hold (-samplemem). */
         char* messages;
         char* buffer;
         int gzipped;
@@ -0,0 +1,508 @@
+#include "samstat.h"
+#include "sketch.h"
+
+struct hll* init_hll(int p)
+{
+        struct hll* hll = NULL;
+
+        ASSERT(p >= 4 && p <= 18, "HyperLogLog precision %d out of range.", p);
+        MMALLOC(hll, sizeof(struct hll));
+        hll->registers = NULL;
+        hll->p = p;
+        hll->m = 1 << p;
+        MMALLOC(hll->registers, sizeof(uint8_t) * hll->m);
+        RUN(clear_hll(hll));
+        return hll;
+ERROR:
+        free_hll(hll);
+        return NULL;
+}
+
+int clear_hll(struct hll* hll)
+{
+        ASSERT(hll != NULL, "No HyperLogLog");
+        memset(hll->registers, 0, sizeof(uint8_t) * hll->m);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_hll(struct hll* hll)
+{
+        if(hll){
+                if(hll->registers){
+                        MFREE(hll->registers);
+                }
+                MFREE(hll);
+        }
+}
+
+/* dst becomes the sketch of the union of both streams. */
+int hll_merge(struct hll* dst,struct hll* src)
+{
+        int i;
+        ASSERT(dst->p == src->p, "Cannot merge HyperLogLogs of different precision.");
+        for(i = 0; i < dst->m;i++){
+                if(src->registers[i] > dst->registers[i]){
+                        dst->registers[i] = src->registers[i];
+                }
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+static double hll_sigma(double x);
+static double hll_tau(double x);
+
+static void top_k_sift_down(struct top_k* tk,int i);
+static void top_k_sift_up(struct top_k* tk,int i);
+static void top_k_unlink(struct top_k* tk,int id);
+
+/* Ertl's improved raw estimator ("New cardinality estimation algorithms for
+   HyperLogLog sketches", 2017): unbiased from empty to saturated registers,
+   so neither linear counting nor empirical bias tables are needed. */
+double hll_estimate(struct hll* hll)
+{
+        int hist[65];
+        int q = 64 - hll->p;
+        double z;
+        int i;
+
+        for(i = 0; i <= q+1;i++){
+                hist[i] = 0;
+        }
+        for(i = 0; i < hll->m;i++){
+                hist[hll->registers[i]]++;
+        }
+        if(hist[0] == hll->m){
+                return 0.0;
+        }
+        z = (double) hll->m * hll_tau(1.0 - (double) hist[q+1] / (double) hll->m);
+        for(i = q; i >= 1;i--){
+                z = 0.5 * (z + (double) hist[i]);
+        }
+        z += (double) hll->m * hll_sigma((double) hist[0] / (double) hll->m);
+        return (double) hll->m * (double) hll->m / (2.0 * log(2.0) * z);
+}
+
+static double hll_sigma(double x)
+{
+        double y = 1.0;
+        double z = x;
+        double z_old;
+        do{
+                x *= x;
+                z_old = z;
+                z += x * y;
+                y += y;
+        }while(z != z_old);
+        return z;
+}
+
+static double hll_tau(double x)
+{
+        double y = 1.0;
+        double z;
+        double z_old;
+        if(x == 0.0 || x == 1.0){
+                return 0.0;
+        }
+        z = 1.0 - x;
+        do{
+                x = sqrt(x);
+                z_old = z;
+                y *= 0.5;
+                z -= (1.0 - x) * (1.0 - x) * y;
+        }while(z != z_old);
+        return z / 3.0;
+}
+
+struct cm_sketch* init_cm_sketch(int width_bits,int depth)
+{
+        struct cm_sketch* cms = NULL;
+
+        ASSERT(width_bits > 0 && width_bits <= 24, "Count-min width %d out of range.", width_bits);
+        ASSERT(depth > 0 && depth <= 8, "Count-min depth %d out of range.", depth);
+        MMALLOC(cms, sizeof(struct cm_sketch));
+        cms->counts = NULL;
+        cms->width_bits = width_bits;
+        cms->depth = depth;
+        MMALLOC(cms->counts, sizeof(unsigned int) * ((size_t) depth << width_bits));
+        RUN(clear_cm_sketch(cms));
+        return cms;
+ERROR:
+        free_cm_sketch(cms);
+        return NULL;
+}
+
+int clear_cm_sketch(struct cm_sketch* cms)
+{
+        ASSERT(cms != NULL, "No count-min sketch");
+        memset(cms->counts, 0, sizeof(unsigned int) * ((size_t) cms->depth << cms->width_bits));
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_cm_sketch(struct cm_sketch* cms)
+{
+        if(cms){
+                if(cms->counts){
+                        MFREE(cms->counts);
+                }
+                MFREE(cms);
+        }
+}
+
+/* Row i uses h1 + i * h2 (Kirsch & Mitzenmacher) - one hash per key. */
+#define CM_CELL(cms,i,h1,h2) ((cms)->counts + ((size_t)(i) << (cms)->width_bits) + (((h1) + (uint32_t)(i) * (h2)) & ((1u << (cms)->width_bits) - 1)))
+
+/* Conservative update: only the smallest counters are raised. Returns the
+   new estimate. */
+unsigned int cm_sketch_add(struct cm_sketch* cms,uint64_t hash)
+{
+        uint32_t h1 = (uint32_t) hash;
+        uint32_t h2 = (uint32_t)(hash >> 32) | 1u;
+        unsigned int min = UINT_MAX;
+        unsigned int* cell;
+        int i;
+
+        for(i = 0; i < cms->depth;i++){
+                cell = CM_CELL(cms, i, h1, h2);
+                if(*cell < min){
+                        min = *cell;
+                }
+        }
+        if(min != UINT_MAX){
+                min++;
+        }
+        for(i = 0; i < cms->depth;i++){
+                cell = CM_CELL(cms, i, h1, h2);
+                if(*cell < min){
+                        *cell = min;
+                }
+        }
+        return min;
+}
+
+unsigned int cm_sketch_estimate(struct cm_sketch* cms,uint64_t hash)
+{
+        uint32_t h1 = (uint32_t) hash;
+        uint32_t h2 = (uint32_t)(hash >> 32) | 1u;
+        unsigned int min = UINT_MAX;
+        unsigned int* cell;
+        int i;
+
+        for(i = 0; i < cms->depth;i++){
+                cell = CM_CELL(cms, i, h1, h2);
+                if(*cell < min){
+                        min = *cell;
+                }
+        }
+        return min;
+}
+
+struct top_k* init_top_k(int k,int seq_len)
+{
+        struct top_k* tk = NULL;
+
+        ASSERT(k > 0, "Top-K list needs at least one counter.");
+        MMALLOC(tk, sizeof(struct top_k));
+        tk->key = NULL;
+        tk->count = NULL;
+        tk->error = NULL;
+        tk->seq = NULL;
+        tk->seq_len_used = NULL;
+        tk->heap = NULL;
+        tk->heap_pos = NULL;
+        tk->slots = NULL;
+        tk->k = k;
+        tk->n = 0;
+        tk->seq_len = seq_len;
+        tk->num_slots = 4;
+        while(tk->num_slots < 4 * k){
+                tk->num_slots = tk->num_slots << 1;
+        }
+        MMALLOC(tk->key, sizeof(uint64_t) * k);
+        MMALLOC(tk->count, sizeof(long long int) * k);
+        MMALLOC(tk->error, sizeof(long long int) * k);
+        MMALLOC(tk->seq, sizeof(char) * k * seq_len);
+        MMALLOC(tk->seq_len_used, sizeof(int) * k);
+        MMALLOC(tk->heap, sizeof(int) * k);
+        MMALLOC(tk->heap_pos, sizeof(int) * k);
+        MMALLOC(tk->slots, sizeof(int) * tk->num_slots);
+        RUN(clear_top_k(tk));
+        return tk;
+ERROR:
+        free_top_k(tk);
+        return NULL;
+}
+
+int clear_top_k(struct top_k* tk)
+{
+        ASSERT(tk != NULL, "No top-K list");
+        tk->n = 0;
+        memset(tk->slots, 0, sizeof(int) * tk->num_slots);
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_top_k(struct top_k* tk)
+{
+        if(tk){
+                if(tk->key){
+                        MFREE(tk->key);
+                }
+                if(tk->count){
+                        MFREE(tk->count);
+                }
+                if(tk->error){
+                        MFREE(tk->error);
+                }
+                if(tk->seq){
+                        MFREE(tk->seq);
+                }
+                if(tk->seq_len_used){
+                        MFREE(tk->seq_len_used);
+                }
+                if(tk->heap){
+                        MFREE(tk->heap);
+                }
+                if(tk->heap_pos){
+                        MFREE(tk->heap_pos);
+                }
+                if(tk->slots){
+                        MFREE(tk->slots);
+                }
+                MFREE(tk);
+        }
+}
+
+/* Counts one occurrence of hash; seq (len bytes, truncated to seq_len) is
+   stored when the key enters the list. Returns the ID of its counter. */
+int top_k_add(struct top_k* tk,uint64_t hash,const char* seq,int len)
+{
+        int mask = tk->num_slots - 1;
+        int s = (int)(hash & mask);
+        int id;
+
+        while(tk->slots[s]){
+                id = tk->slots[s] - 1;
+                if(tk->key[id] == hash){
+                        tk->count[id]++;
+                        top_k_sift_down(tk, tk->heap_pos[id]);
+                        return id;
+                }
+                s = (s + 1) & mask;
+        }
+        if(tk->n < tk->k){
+                id = tk->n;
+                tk->n++;
+                tk->count[id] = 1;
+                tk->error[id] = 0;
+                tk->heap[id] = id;
+                tk->heap_pos[id] = id;
+                top_k_sift_up(tk, id);
+        }else{
+                /* replace the smallest counter; the new key inherits its count */
+                id = tk->heap[0];
+                top_k_unlink(tk, id);
+                tk->error[id] = tk->count[id];
+                tk->count[id]++;
+                s = (int)(hash & mask);
+                while(tk->slots[s]){
+                        s = (s + 1) & mask;
+                }
+                top_k_sift_down(tk, 0);
+        }
+        tk->slots[s] = id + 1;
+        tk->key[id] = hash;
+        if(len > tk->seq_len){
+                len = tk->seq_len;
+        }
+        memcpy(tk->seq + (size_t) id * tk->seq_len, seq, len);
+        tk->seq_len_used[id] = len;
+        return id;
+}
+
+/* Removes id from the hash (backward shift deletion - no tombstones). */
+static void top_k_unlink(struct top_k* tk,int id)
+{
+        int mask = tk->num_slots - 1;
+        int s = (int)(tk->key[id] & mask);
+        int next,home;
+
+        while(tk->slots[s] != id + 1){
+                s = (s + 1) & mask;
+        }
+        next = (s + 1) & mask;
+        while(tk->slots[next]){
+                home = (int)(tk->key[tk->slots[next] - 1] & mask);
+                /* move the entry back if its home slot is not in (s, next] */
+                if(((next - home) & mask) >= ((next - s) & mask)){
+                        tk->slots[s] = tk->slots[next];
+                        s = next;
+                }
+                next = (next + 1) & mask;
+        }
+        tk->slots[s] = 0;
+}
+
+static void top_k_sift_down(struct top_k* tk,int i)
+{
+        int c,tmp;
+        while((c = 2 * i + 1) < tk->n){
+                if(c + 1 < tk->n && tk->count[tk->heap[c+1]] < tk->count[tk->heap[c]]){
+                        c++;
+                }
+                if(tk->count[tk->heap[i]] <= tk->count[tk->heap[c]]){
+                        break;
+                }
+                tmp = tk->heap[i];
+                tk->heap[i] = tk->heap[c];
+                tk->heap[c] = tmp;
+                tk->heap_pos[tk->heap[i]] = i;
+                tk->heap_pos[tk->heap[c]] = c;
+                i = c;
+        }
+}
+
+static void top_k_sift_up(struct top_k* tk,int i)
+{
+        int p,tmp;
+        while(i){
+                p = (i - 1) / 2;
+                if(tk->count[tk->heap[p]] <= tk->count[tk->heap[i]]){
+                        break;
+                }
+                tmp = tk->heap[i];
+                tk->heap[i] = tk->heap[p];
+                tk->heap[p] = tmp;
+                tk->heap_pos[tk->heap[i]] = i;
+                tk->heap_pos[tk->heap[p]] = p;
+                i = p;
+        }
+}
+
+struct reservoir* init_reservoir(int k,long long int max_bytes)
+{
+        struct reservoir* rs = NULL;
+        int i;
+
+        ASSERT(k > 0, "Reservoir needs at least one slot.");
+        ASSERT(max_bytes > 0, "Reservoir needs some memory.");
+        MMALLOC(rs, sizeof(struct reservoir));
+        rs->seq = NULL;
+        rs->len = NULL;
+        rs->alloc = NULL;
+        rs->k = k;
+        rs->bytes = 0;
+        rs->max_bytes = max_bytes;
+        MMALLOC(rs->seq, sizeof(char*) * k);
+        MMALLOC(rs->len, sizeof(int) * k);
+        MMALLOC(rs->alloc, sizeof(int) * k);
+        for(i = 0; i < k;i++){
+                rs->seq[i] = NULL;
+                rs->len[i] = 0;
+                rs->alloc[i] = 0;
+        }
+        RUN(clear_reservoir(rs));
+        return rs;
+ERROR:
+        free_reservoir(rs);
+        return NULL;
+}
+
+int clear_reservoir(struct reservoir* rs)
+{
+        int i;
+        ASSERT(rs != NULL, "No reservoir");
+        /* a large sample of the last file should not squeeze this one */
+        for(i = 0; i < rs->k;i++){
+                if(rs->seq[i]){
+                        MFREE(rs->seq[i]);
+                }
+                rs->len[i] = 0;
+                rs->alloc[i] = 0;
+        }
+        rs->bytes = 0;
+        rs->seen = 0;
+        rs->n = 0;
+        rs->size = rs->k;
+        rs->rng = 0;
+        return OK;
+ERROR:
+        return FAIL;
+}
+
+void free_reservoir(struct reservoir* rs)
+{
+        int i;
+        if(rs){
+                if(rs->seq){
+                        for(i = 0; i < rs->k;i++){
+                                if(rs->seq[i]){
+                                        MFREE(rs->seq[i]);
+                                }
+                        }
+                        MFREE(rs->seq);
+                }
+                if(rs->len){
+                        MFREE(rs->len);
+                }
+                if(rs->alloc){
+                        MFREE(rs->alloc);
+                }
+                MFREE(rs);
+        }
+}
+
+int reservoir_add(struct reservoir* rs,const char* seq,int len)
+{
+        char* tmp = NULL;
+        uint64_t r;
+        int i;
+
+        rs->seen++;
+        if(rs->n < rs->size){
+                i = rs->n;
+                rs->n++;
+        }else{
+                /* splitmix64 stream */
+                rs->rng += 0x9e3779b97f4a7c15ULL;
+                r = hash_mix64(rs->rng) % (uint64_t) rs->seen;
+                if(r >= (uint64_t) rs->size){
+                        return OK;
+                }
+                i = (int) r;
+        }
+        if(rs->alloc[i] <= len){
+                MREALLOC(rs->seq[i], sizeof(char) * (len + 1));
+                rs->bytes += len + 1 - rs->alloc[i];
+                rs->alloc[i] = len + 1;
+        }
+        memcpy(rs->seq[i], seq, len);
+        rs->len[i] = len;
+
+        /* over the memory bound: drop random sequences for good */
+        while(rs->bytes > rs->max_bytes && rs->n > 1){
+                rs->rng += 0x9e3779b97f4a7c15ULL;
+                i = (int)(hash_mix64(rs->rng) % (uint64_t) rs->n);
+                rs->n--;
+                tmp = rs->seq[i];
+                rs->seq[i] = rs->seq[rs->n];
+                rs->seq[rs->n] = tmp;
+                rs->len[i] = rs->len[rs->n];
+                rs->bytes -= rs->alloc[i];
+                rs->alloc[i] = rs->alloc[rs->n];
+                MFREE(rs->seq[rs->n]);
+                rs->alloc[rs->n] = 0;
+                rs->len[rs->n] = 0;
+                rs->size = rs->n;
+        }
+        return OK;
+ERROR:
+        return FAIL;
+}
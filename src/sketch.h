@@ -0,0 +1,123 @@
+#ifndef SKETCH_HEADER
+
+#define SKETCH_HEADER
+
+#include <stdint.h>
+
+/* Fixed memory summaries of streams too large to keep: a HyperLogLog
+   counter of distinct keys (used to estimate duplicate rates), a count-min
+   sketch of key frequencies, a Space-Saving top-K list of the most
+   frequent keys (used to find overrepresented sequences) and a reservoir
+   sample of sequences (used to train the HMMs). */
+
+struct hll{
+        uint8_t* registers;
+        int p;/**< @brief 2^p registers; standard error ~1.04 / sqrt(2^p). */
+        int m;
+};
+
+/* Count-min with conservative update; depth rows of 2^width_bits counters. */
+struct cm_sketch{
+        unsigned int* counts;
+        int width_bits;
+        int depth;
+};
+
+/* Space-Saving (Metwally et al. 2005): k counters kept in a min-heap and
+   found through an open addressing hash on the 64 bit key. Any key seen
+   more than N / k times is guaranteed to be in the list. For each key the
+   first seq_len bytes of the item are stored for reporting. */
+struct top_k{
+        uint64_t* key;
+        long long int* count;
+        long long int* error;/**< @brief Upper bound on overcounting. */
+        char* seq;
+        int* seq_len_used;
+        int* heap;
+        int* heap_pos;
+        int* slots;/**< @brief id + 1, 0 = empty */
+        int k;
+        int n;
+        int seq_len;
+        int num_slots;
+};
+
+/* Algorithm R (Vitter 1985): after n sequences every one of them is in
+   the sample with probability size / n. Sequences are copied; slot buffers
+   only grow until clear_reservoir frees them. If the buffers hold more
+   than max_bytes, random sequences are dropped and size shrinks to what is
+   left - a uniform subsample of a uniform sample is still uniform. The random stream is
+   reset by clear_reservoir, so the same input gives the same sample. */
+struct reservoir{
+        char** seq;
+        int* len;
+        int* alloc;
+        long long int seen;
+        long long int bytes;/**< @brief Sum of alloc. */
+        long long int max_bytes;
+        uint64_t rng;
+        int k;/**< @brief Slots allocated; the largest sample. */
+        int size;/**< @brief Current sample size, at most k. */
+        int n;/**< @brief Sequences in the sample: min(seen, size). */
+};
+
+struct hll* init_hll(int p);
+int clear_hll(struct hll* hll);
+void free_hll(struct hll* hll);
+int hll_merge(struct hll* dst,struct hll* src);
+double hll_estimate(struct hll* hll);
+
+struct cm_sketch* init_cm_sketch(int width_bits,int depth);
+int clear_cm_sketch(struct cm_sketch* cms);
+void free_cm_sketch(struct cm_sketch* cms);
+unsigned int cm_sketch_add(struct cm_sketch* cms,uint64_t hash);
+unsigned int cm_sketch_estimate(struct cm_sketch* cms,uint64_t hash);
+
+struct top_k* init_top_k(int k,int seq_len);
+int clear_top_k(struct top_k* tk);
+void free_top_k(struct top_k* tk);
+int top_k_add(struct top_k* tk,uint64_t hash,const char* seq,int len);
+
+struct reservoir* init_reservoir(int k,long long int max_bytes);
+int clear_reservoir(struct reservoir* rs);
+void free_reservoir(struct reservoir* rs);
+int reservoir_add(struct reservoir* rs,const char* seq,int len);
+
+/* 64 bit finalizer (splitmix64) - spreads structured keys over all bits. */
+static inline uint64_t hash_mix64(uint64_t x)
+{
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+}
+
+static inline uint64_t hash_bytes64(const char* s,int len)
+{
+        uint64_t h = 14695981039346656037ULL;
+        int i;
+        for(i = 0; i < len;i++){
+                h ^= (unsigned char) s[i];
+                h *= 1099511628211ULL;
+        }
+        return hash_mix64(h);
+}
+
+static inline void hll_add(struct hll* hll,uint64_t hash)
+{
+        uint64_t w = hash << hll->p;
+        int r = 1;
+        int i = (int)(hash >> (64 - hll->p));
+
+        while(r <= 64 - hll->p && !(w & 0x8000000000000000ULL)){
+                w <<= 1;
+                r++;
+        }
+        if(r > hll->registers[i]){
+                hll->registers[i] = (uint8_t) r;
+        }
+}
+
+#endif